@@ -1,275 +1,868 @@
 #include <string>
+#include <string_view>
 #include <vector>
-#include <bitset>
 #include <iostream>
 #include <memory>
-#include <fstream>
-#include <effolkronium/random.hpp>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <type_traits>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "bloomfilter.hpp"
 
-/// Random generation library which works without seed boilerplate.
-using rand_gen = effolkronium::random_static;
 
+/** Parses a command from a given command string by splitting by the first space
+ * and taking the first word.
+ *
+ * \param  input The input line containing the command.
+ * \return       The first word in the input line.
+ */
+std::string_view get_command(std::string_view input) {
+    return input.substr(0, input.find(' '));
+}
+
+/** Parses the string part of a command string by removing the first word.
+ *
+ * \param  input The string to parse the input string from.
+ * \return       The string that was parsed.
+ *
+ */
+std::string_view get_string(std::string_view input) {
+    return input.substr(input.find(' ') + 1);
+}
 
-/// Abstract template for different hash implementations.
-template <typename T>
-class hash_function {
 
-    /** Class abstraction for a hash definition. Should return a hash for a
-     * given type of element.
-     *
-     * \param  elem An element of type T which this class should hash.
-     * \return      The hash code for the given element. 
-     */
-    virtual size_t hash(T elem) = 0;
+/// Reads a command file in large chunks of whole lines. Regular files are
+/// mapped and handed out as a single chunk; pipes, including stdin when the
+/// path is "-", are read a block at a time so that commands can be streamed.
+class command_reader {
 
-    public:
+    // The file being read.
+    int fd;
 
-    /** Function overload for this class. 
-     *
-     * The only purpose of this is to call the private definition for `hash`.
-     *
-     * \param  elem An element of type T which this class should hash.
-     * \return      The hash code for the given element. 
-     */
-    size_t operator()(T elem) { return hash(elem); };
+    // Whether `fd` was opened here and must be closed.
+    bool owned;
 
-};
+    // Mapping of a regular file, null when reading a pipe.
+    std::unique_ptr<mapped_file> file;
 
+    // Block the pipe is read into.
+    std::vector<char> buffer;
 
-/// Short hand for hash functions involving a string
-typedef hash_function<std::string> hash;
-typedef std::shared_ptr<hash> hash_ptr;
+    // Start and length of the unfinished line left after the last chunk.
+    size_t rest = 0;
+    size_t rest_len = 0;
 
+    // Whether the end of the input has been reached.
+    bool done = false;
 
-/// Class implementation for the string folding hash function with a given seed.
-class sfold : public hash {
+    public:
 
-    // The seed used for incrementing the multiplier in this hash.
-    size_t seed;
+    /// The size of a block read from a pipe.
+    static constexpr size_t block = 1 << 20;
 
-    /** Hash function for the sfold, which operates by handling every 4 bytes of
-     * a string and adding them to a sum. Bytes are offset by the `seed`.
+    /** Opens a command file.
+     *
+     * \param path The path of the file, or "-" for stdin.
      */
-    virtual size_t hash(std::string elem) {
-        size_t size = elem.size() / 4;
-        size_t sum = 0;
-        for(size_t i = 0; i < size; i++) {
-            const char* c = elem.substr(i * 4, 4).c_str();
-            size_t mult = 1;
-            for(size_t j = 0; j < sizeof(c) / sizeof(char); j++) {
-                sum += c[j] * mult;
-                mult *= seed;
+    explicit command_reader(const std::string& path)
+        : fd(path == "-" ? 0 : open(path.c_str(), O_RDONLY)), owned(path != "-") {
+        if(fd < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            done = st.st_size == 0;
+            if(!done) {
+                file.reset(new mapped_file(fd, path));
+                madvise(file->data(), file->size(), MADV_SEQUENTIAL);
             }
+        } else {
+            buffer.resize(block);
         }
-        return sum + 1;
     }
 
-    public:
+    ~command_reader() {
+        if(owned) {
+            close(fd);
+        }
+    }
+
+    command_reader(const command_reader&) = delete;
+    command_reader& operator=(const command_reader&) = delete;
 
-    /** Public constructor for the sfold hash function. Requires a seed for
-     * projection.
+    /** Reads the next chunk of whole lines. Only the last chunk of the input
+     * may end without a newline.
      *
-     * \param seed The seed for projecting the string.
+     * \param  chunk Set to the lines read. It stays valid until the next call.
+     * \return       False once the input is exhausted.
      */
-    sfold(size_t seed) {
-        this->seed = seed; 
+    bool next(std::string_view& chunk) {
+        if(done) {
+            return false;
+        }
+        if(file) {
+            done = true;
+            chunk = std::string_view(file->data(), file->size());
+            return true;
+        }
+
+        std::memmove(buffer.data(), buffer.data() + rest, rest_len);
+        size_t end = rest_len;
+        while(true) {
+            // A line longer than the block grows it.
+            if(end == buffer.size()) {
+                buffer.resize(buffer.size() * 2);
+            }
+            ssize_t r = read(fd, buffer.data() + end, buffer.size() - end);
+            if(r < 0 && errno == EINTR) {
+                continue;
+            }
+            if(r < 0) {
+                throw std::runtime_error("cannot read commands");
+            }
+            if(r == 0) {
+                done = true;
+                chunk = std::string_view(buffer.data(), end);
+                return end > 0;
+            }
+            size_t scanned = end;
+            end += r;
+            size_t last = end;
+            while(last > scanned && buffer[last - 1] != '\n') {
+                last--;
+            }
+            if(last > scanned) {
+                chunk = std::string_view(buffer.data(), last);
+                rest = last;
+                rest_len = end - last;
+                return true;
+            }
+        }
     }
 
 };
 
 
+/** Calls `f` on every line of a chunk, without its newline.
+ *
+ * \param chunk The lines.
+ * \param f     The function run on each line.
+ */
+template <typename F>
+void for_each_line(std::string_view chunk, F f) {
+    while(!chunk.empty()) {
+        size_t nl = chunk.find('\n');
+        f(chunk.substr(0, nl));
+        chunk.remove_prefix(nl == std::string_view::npos ? chunk.size() : nl + 1);
+    }
+}
+
 
-/// Class implementation for the bloom filter data structure.
-class bloom_filter {
+/// Buffers the results of membership tests and writes them to stdout in large
+/// blocks. Results are written as "true" and "false" lines, or as a bitmap
+/// holding result i in bit i % 8 of byte i / 8.
+class result_writer {
 
-    private:
+    // Output which has not been written yet.
+    std::string buffer;
 
-        // Bit set for checking if an element occupies the set.
-        std::vector<bool> set;
-        
-        // Array of hashers initialized at construction which are used for
-        // storing and testing membership.
-        std::vector<hash_ptr> hashers;
+    // Whether results are written as a bitmap.
+    bool binary;
 
+    // The byte of the bitmap being filled, and how many of its bits are.
+    unsigned char byte = 0;
+    unsigned bits = 0;
 
     public:
 
-        /** Inserts an element into the bloom filter by running it through each
-         * stored hasher and setting all those bits to 1 in the bit set.
-         *
-         * \param str The string to insert into the bloom filter
-         */
-        void insert(std::string str) {
-            for(hash_ptr h : this->hashers) {
-                size_t j = (*h)(str) % set.size();
-                set[j] = 1;
+    /// The amount of output buffered before it is written.
+    static constexpr size_t block = 1 << 20;
+
+    /** Adds the result of a membership test. */
+    void put(bool found) {
+        if(binary) {
+            byte |= found << bits;
+            if(++bits == 8) {
+                buffer.push_back(byte);
+                byte = 0;
+                bits = 0;
             }
+        } else {
+            buffer.append(found ? "true\n" : "false\n", found ? 5 : 6);
         }
+        if(buffer.size() >= block) {
+            flush();
+        }
+    }
 
-        /** Tests if a string is in the bloom filter by running it through each
-         * stored hasher and checking all those bits are 1 in the bit set.
-         *
-         * \param  str The string to test for membership
-         * \return     True if the string is in the set, false otherwise.
-         */
-        bool test_membership(std::string str) {
-            for(hash_ptr h : this->hashers) {
-                size_t j = (*h)(str) % set.size();
-                if(!set[j]) {
-                    return false;
-                }
+    /** Writes all buffered output. A partly filled byte of the bitmap is kept
+     * back until `finish`.
+     */
+    void flush() {
+        size_t done = 0;
+        while(done < buffer.size()) {
+            ssize_t w = write(1, buffer.data() + done, buffer.size() - done);
+            if(w < 0 && errno == EINTR) {
+                continue;
             }
-            return true;
+            if(w < 0) {
+                throw std::runtime_error("cannot write results");
+            }
+            done += w;
         }
+        buffer.clear();
+    }
 
-        /** Resets the bitset to all 0's.  */
-        void reset() { std::fill(set.begin(), set.end(), 0); };
-
-        /** Initializes the bloom filter.
-         *
-         * \param size        The maximum size of the bitset and corresponding 
-         *                    index.
-         * \param num_hashers The number of hashers being used.
-         * \param hashers     An array containing pointers to all the hashers we
-         *                    are using. We use an array of pointers since the
-         *                    underlying base class is abstract. 
-         *
-         */
-        bloom_filter(size_t size, std::vector<hash_ptr>& hashers) {
-            for(size_t i = 0; i < size; i++) {
-                this->set.push_back(0);
-            }
-            this->hashers = hashers;
-        };
+    /** Writes all output, padding the last byte of the bitmap with 0's. */
+    void finish() {
+        if(bits > 0) {
+            buffer.push_back(byte);
+            byte = 0;
+            bits = 0;
+        }
+        flush();
+    }
+
+    /** Initializes the writer.
+     *
+     * \param binary Whether results are written as a bitmap.
+     */
+    explicit result_writer(bool binary = false) : binary(binary) {
+        buffer.reserve(block + 8);
+    }
 
 };
 
 
-/** Constructs sfold hashs from a given list of seeds.
- *
- * \param k     The number of sfold hashs that should be constructed.
- * \param seeds The list of seeds that the k sfold hashs should choose from
- *              wihtout replacement.
- * \return      Array of pointers to sfold hashs. They are returned this way
- *              since the underlying class, hash_function, is abstract.
- */
-std::vector<hash_ptr> construct_random_sfold_hashs(size_t k, std::vector<size_t> seeds) {
+/// Consecutive lines of the same command, buffered so that they can be run
+/// through a filter's batch operations.
+struct command_batch {
+
+    /// The command shared by every buffered line.
+    enum class op { none, insert, test } command = op::none;
 
-    std::vector<hash_ptr> v;
+    /// The strings of the buffered lines. Only the first `n` are in use.
+    std::string_view keys[batch_size];
 
-    // Rather than run a choice function (which this library doesn't have), we
-    // equivalently just shuffle all the elements of the vector and just take
-    // the first k.
-    rand_gen::shuffle(seeds);
-    for(size_t i = 0; i < k; i++) {
-        v.push_back(hash_ptr(new sfold(seeds[i])));
+    /// The number of buffered lines.
+    size_t n = 0;
+
+};
+
+/** Runs the buffered lines of a batch on a bloom filter and empties it.
+ *
+ * @param batch The batch to run.
+ * @param bf    The bloom filter.
+ * @param out   Where the results of tests are written.
+ */
+template <typename Filter>
+void flush_batch(command_batch& batch, Filter& bf, result_writer& out) {
+    if(batch.command == command_batch::op::insert) {
+        bf.insert_batch(batch.keys, batch.n);
+    } else if(batch.command == command_batch::op::test) {
+        build_filter(bf);
+        uint64_t found = bf.test_membership_batch(batch.keys, batch.n);
+        for(size_t i = 0; i < batch.n; i++) {
+            out.put((found >> i) & 1);
+        }
     }
-    return v;
+    batch.command = command_batch::op::none;
+    batch.n = 0;
 }
 
-/** Generates all primes less than n using the Sieve of Erastosthenes method.
+/// Whether a filter can remove elements.
+template <typename Filter, typename = void>
+struct can_remove : std::false_type {};
+
+template <typename Filter>
+struct can_remove<Filter, std::void_t<decltype(std::declval<Filter&>().remove(std::string_view()))>>
+    : std::true_type {};
+
+/** Removes an element from a filter, or fails if the filter cannot remove
+ * elements.
  *
- * \param n The upper limit for the primes.
- * \return  A vector containing all the primes between 2 and n.
+ * @param bf  The bloom filter.
+ * @param str The string to remove.
  */
-std::vector<size_t> gen_primes(size_t n) {
-    std::vector<size_t> p;
-    std::vector<bool> p_test;
-    for(size_t i = 0; i < n; i++) {
-        p_test.push_back(true);
-    }
-    for(size_t i = 2; (i * i) < n; i++) {
-        if(p_test[i]) {
-            p.push_back(i);
-            for(size_t j = (i * i); j < n; j += i) {
-                p_test[j] = false;
-            } 
-        }
+template <typename Filter>
+void remove_element(Filter& bf, std::string_view str) {
+    if constexpr (can_remove<Filter>::value) {
+        bf.remove(str);
+    } else {
+        throw std::runtime_error("remove is only supported by the counting mode");
     }
-    return p;
 }
 
-/** Parses a command from a given command string by splitting by the first space
- * and taking the first word.
+/// Whether a filter can be merged with another of its kind.
+template <typename Filter, typename = void>
+struct can_merge : std::false_type {};
+
+template <typename Filter>
+struct can_merge<Filter, std::void_t<decltype(std::declval<Filter&>().unite(std::declval<const Filter&>()))>>
+    : std::true_type {};
+
+/** Merges a saved filter into a filter, or fails if the filter cannot be
+ * merged.
  *
- * \param  input The input line containing the command.
- * \return       The first word in the input line.
+ * @param bf     The bloom filter.
+ * @param path   The path of the saved filter to merge.
+ * @param unite  Whether to take the union of the filters rather than their
+ *               intersection.
+ * @param verify Whether to check the saved words against their checksum.
  */
-std::string get_command(std::string input) {
-    return input.substr(0, input.find(" "));
+template <typename Filter>
+void merge_filter(Filter& bf, const std::string& path, bool unite, bool verify) {
+    if constexpr (can_merge<Filter>::value) {
+        Filter other = Filter::load(path, verify);
+        if(unite) {
+            bf.unite(other);
+        } else {
+            bf.intersect(other);
+        }
+    } else {
+        throw std::runtime_error("union and intersect are only supported by the classic and blocked modes");
+    }
 }
 
-/** Parses the string part of a command string by removing the first word.
+/** Runs a series of commands from a given file on a bloom filter.
  *
- * \param  input The string to parse the input string from.
- * \return       The string that was parsed.
+ * Accepts one of ten commands in each line of the file:
+ *          reset      [resets the bloom filter]
+ *         insert str  [inserts the string into the bloom filter]
+ *         remove str  [removes the string from a counting bloom filter]
+ * testmembership str  [tests if the string is in the bloom filter]
+ *          build      [builds an xor filter from the strings inserted]
+ *           save path [saves the bloom filter to a file]
+ *           load path [replaces the bloom filter with one saved to a file]
+ *          union path [adds the elements of a saved bloom filter]
+ *      intersect path [keeps the bits also set in a saved bloom filter]
+ *          stats      [prints statistics of the bloom filter as JSON]
  *
+ * Statistics are printed on stderr, so that they never mix with the results
+ * of tests. An xor filter is also built by the first test or save after an insert.
+ * Runs of consecutive `insert` or `testmembership` lines are handed to the
+ * filter in batches. A batch is run before any line with a different command,
+ * so every test still sees exactly the inserts that precede it. Lines are
+ * parsed in place, so no line is copied.
+ *
+ * @param  path   The path to the file containing the commands for the bloom
+ *                filter, or "-" for stdin.
+ * @param  bf     The bloom filter.
+ * @param  out    Where the results of tests are written.
+ * @param  verify Whether saved filters which are loaded or merged have their
+ *                words checked against their checksum.
+ * @return        The number of lines that were run.
  */
-std::string get_string(std::string input) {
-    return input.substr(input.find(" ") + 1, input.size());
+template <typename Filter>
+size_t run_commands(std::string path, Filter& bf, result_writer& out, bool verify) {
+    command_reader file(path);
+
+    command_batch batch;
+    size_t lines = 0;
+    std::string_view chunk;
+    while(file.next(chunk)) {
+        for_each_line(chunk, [&](std::string_view line) {
+            lines++;
+            std::string_view command = get_command(line);
+            if (command == "reset") {
+                flush_batch(batch, bf, out);
+                bf.reset();
+            } else if (command == "build") {
+                flush_batch(batch, bf, out);
+                build_filter(bf);
+            } else if (command == "save") {
+                flush_batch(batch, bf, out);
+                build_filter(bf);
+                bf.save(std::string(get_string(line)));
+            } else if (command == "load") {
+                flush_batch(batch, bf, out);
+                bf = Filter::load(std::string(get_string(line)), verify);
+            } else if (command == "remove") {
+                flush_batch(batch, bf, out);
+                remove_element(bf, get_string(line));
+            } else if (command == "union" || command == "intersect") {
+                flush_batch(batch, bf, out);
+                merge_filter(bf, std::string(get_string(line)), command == "union", verify);
+            } else if (command == "stats") {
+                flush_batch(batch, bf, out);
+                std::cerr << bf.stats() << std::endl;
+            } else {
+
+                command_batch::op op = command_batch::op::none;
+                if (command == "insert") {
+                    op = command_batch::op::insert;
+                }
+                else if (command == "testmembership") {
+                    op = command_batch::op::test;
+                }
+                else {
+                    return;
+                }
+
+                if(op != batch.command || batch.n == batch_size) {
+                    flush_batch(batch, bf, out);
+                }
+                batch.command = op;
+                batch.keys[batch.n++] = get_string(line);
+
+            }
+        });
+
+        // The lines of a chunk are only valid until the next one is read.
+        // Results are written out as well, so streamed commands are answered
+        // as they arrive.
+        flush_batch(batch, bf, out);
+        out.flush();
+    }
+
+    return lines;
 }
- 
-/** Runs a series of commands from a given file on a bloom filter. 
+
+/// The fewest items each thread of a `worker_pool` is handed. Smaller runs are
+/// split over fewer threads, or run on the calling thread alone, since waking
+/// a thread costs more than the work it would take over.
+constexpr size_t min_items_per_thread = 4096;
+
+/// A fixed set of threads, started once, which split ranges of items with the
+/// calling thread.
+class worker_pool {
+
+    // The threads besides the calling one.
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    // The function run on each range of the current run, the number of items,
+    // and the number of items per range.
+    std::function<void(size_t, size_t)> task;
+    size_t items = 0;
+    size_t chunk = 0;
+
+    // Counts the runs started, so that a worker joins each run only once.
+    size_t generation = 0;
+
+    // The number of workers taking part in the current run, and how many of
+    // them have not finished it yet.
+    size_t parts = 0;
+    size_t running = 0;
+
+    bool stop = false;
+
+    /** Waits for runs and does the range of worker `w`, counting from 1. */
+    void work(size_t w) {
+        size_t seen = 0;
+        while(true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stop || generation != seen; });
+            if(stop) {
+                return;
+            }
+            seen = generation;
+            if(w >= parts) {
+                continue;
+            }
+            size_t begin = w * chunk;
+            size_t end = std::min(begin + chunk, items);
+            lock.unlock();
+            task(begin, end);
+            lock.lock();
+            if(--running == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+    public:
+
+    /** Starts the threads.
+     *
+     * \param threads The number of threads, including the calling one.
+     */
+    explicit worker_pool(size_t threads) {
+        for(size_t w = 1; w < threads; w++) {
+            workers.emplace_back(&worker_pool::work, this, w);
+        }
+    }
+
+    ~worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for(std::thread& t : workers) {
+            t.join();
+        }
+    }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    /** Splits [0, n) into contiguous ranges of at least
+     * `min_items_per_thread` items, one per thread at most, and runs
+     * `f(begin, end)` on each, returning once every range has finished.
+     *
+     * \param n The number of items.
+     * \param f The function run on each range.
+     */
+    template <typename F>
+    void run(size_t n, F f) {
+        size_t p = std::min(workers.size() + 1, n / min_items_per_thread);
+        if(p <= 1) {
+            f(0, n);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = f;
+            items = n;
+            chunk = (n + p - 1) / p;
+            parts = p;
+            running = p - 1;
+            generation++;
+        }
+        wake.notify_all();
+        f(0, chunk);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() { return running == 0; });
+    }
+
+};
+
+/// The most lines buffered by a parallel run before its phase is executed.
+constexpr size_t phase_lines = 1 << 20;
+
+/** Runs a series of commands from a given file on a bloom filter, spreading
+ * the work over several threads. Accepts the same commands as `run_commands`
+ * and prints the same output.
  *
- * Accepts one of three commands in each line of the file:
- *          reset     [resets the bloom filter]
- *         insert str [inserts the string into the bloom filter]
- * testmembership str [tests if the string is in the bloom filter]
+ * The file is split into phases, each a run of inserts followed by a run of
+ * tests. A phase ends at any other command, or at an insert which follows a
+ * test. All inserts of a phase are run in parallel and finish before its
+ * tests are run in parallel, so every test still sees exactly the inserts that
+ * precede it. Results are written in file order once a phase is done. The
+ * threads are started once per run, and short phases run on the calling
+ * thread alone.
  *
- * @param  path The path to the file containing the commands for the bloom
- *              filter.
- * @param  bf   The bloom filter.
+ * @param  path    The path to the file containing the commands for the bloom
+ *                 filter, or "-" for stdin.
+ * @param  bf      The bloom filter. It must support concurrent inserts and
+ *                 tests.
+ * @param  threads The number of threads to run the commands on.
+ * @param  out     Where the results of tests are written.
+ * @param  verify  Whether saved filters which are loaded or merged have their
+ *                 words checked against their checksum.
+ * @return         The number of lines that were run.
  */
-void run_commands(std::string path, bloom_filter& bf) {
-    std::ifstream file;
-    file.open(path);
-
-    std::string line;
-    while(std::getline(file, line)) {
-        std::string command = get_command(line);
-        if (command == "reset") {
-            bf.reset();
-        } else {
-
-            std::string str = get_string(line);
-            if (command == "insert") {
-                bf.insert(str);
+template <typename Filter>
+size_t run_commands_parallel(std::string path, Filter& bf, size_t threads, result_writer& out,
+                             bool verify) {
+    command_reader file(path);
+    worker_pool pool(threads);
+
+    std::vector<std::string_view> inserts;
+    std::vector<std::string_view> tests;
+    std::vector<char> found;
+
+    auto run_phase = [&]() {
+        pool.run(inserts.size(), [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i += batch_size) {
+                bf.insert_batch(&inserts[i], std::min(batch_size, end - i));
             }
-            else if (command == "testmembership") {
-                std::cout << (bf.test_membership(str) ? "true" : "false") << std::endl;
+        });
+
+        found.resize(tests.size());
+        pool.run(tests.size(), [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; i += batch_size) {
+                size_t n = std::min(batch_size, end - i);
+                uint64_t mask = bf.test_membership_batch(&tests[i], n);
+                for(size_t j = 0; j < n; j++) {
+                    found[i + j] = (mask >> j) & 1;
+                }
             }
-        
+        });
+
+        for(char f : found) {
+            out.put(f);
         }
 
+        inserts.clear();
+        tests.clear();
+        found.clear();
+    };
+
+    size_t lines = 0;
+    std::string_view chunk;
+    while(file.next(chunk)) {
+        for_each_line(chunk, [&](std::string_view line) {
+            lines++;
+            std::string_view command = get_command(line);
+            if (command == "reset") {
+                run_phase();
+                bf.reset();
+            } else if (command == "save") {
+                run_phase();
+                bf.save(std::string(get_string(line)));
+            } else if (command == "load") {
+                run_phase();
+                bf = Filter::load(std::string(get_string(line)), verify);
+            } else if (command == "remove") {
+                run_phase();
+                remove_element(bf, get_string(line));
+            } else if (command == "union" || command == "intersect") {
+                run_phase();
+                merge_filter(bf, std::string(get_string(line)), command == "union", verify);
+            } else if (command == "stats") {
+                run_phase();
+                std::cerr << bf.stats() << std::endl;
+            } else if (command == "insert") {
+                if(!tests.empty()) {
+                    run_phase();
+                }
+                inserts.push_back(get_string(line));
+            } else if (command == "testmembership") {
+                tests.push_back(get_string(line));
+            }
+
+            if(inserts.size() + tests.size() >= phase_lines) {
+                run_phase();
+            }
+        });
+
+        // The lines of a chunk are only valid until the next one is read.
+        run_phase();
+        out.flush();
     }
 
-    file.close();
+    return lines;
+}
+
+/// Options given on the command line.
+struct options {
+    size_t size = 0;
+    size_t k = 0;
+    std::string path;
+    std::string hash = "wyhash";
+    std::string mode = "classic";
+    unsigned counter_bits = 4;
+    size_t threads = 1;
+    // Whether --threads was given, which selects the concurrent filter even
+    // for a single thread.
+    bool concurrent = false;
+    bool time = false;
+    std::string load;
+    bool verify = false;
+    bool binary = false;
+    bool seeded = false;
+    uint64_t seed = 0;
+    size_t items = 0;
+    double fp_rate = 0;
+};
+
+/** Builds the filter from the given constructor arguments, or loads it when
+ * asked to, and runs the commands against it, reporting the time taken per
+ * command on stderr when asked to.
+ */
+template <typename Filter, typename... Args>
+void run_filter(const options& opts, Args&&... args) {
+    Filter bf = opts.load.empty()
+        ? Filter(std::forward<Args>(args)...)
+        : Filter::load(opts.load, opts.verify);
+
+    result_writer out(opts.binary);
+    auto start = std::chrono::steady_clock::now();
+    size_t lines;
+    try {
+        lines = opts.concurrent
+            ? run_commands_parallel(opts.path, bf, opts.threads, out, opts.verify)
+            : run_commands(opts.path, bf, out, opts.verify);
+    } catch(...) {
+        // The results of the commands before the failing one still go out.
+        out.finish();
+        throw;
+    }
+    out.finish();
+    auto end = std::chrono::steady_clock::now();
+    if(opts.time) {
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        std::cerr << lines << " commands in " << ns / 1e6 << " ms ("
+                  << (lines ? ns / lines : 0) << " ns/op)" << std::endl;
+    }
+}
+
+/** Builds the filter of the chosen mode with the given hash policy and runs the
+ * commands against it.
+ */
+template <typename Hasher>
+void run(const options& opts, Hasher hasher) {
+    if(opts.mode == "scalable") {
+        run_filter<scalable_bloom_filter<Hasher>>(opts, opts.items, opts.fp_rate, std::move(hasher));
+    } else if(opts.mode == "xor") {
+        run_filter<xor_filter<Hasher>>(opts, std::move(hasher));
+    } else if(opts.mode == "blocked") {
+        run_filter<blocked_bloom_filter<Hasher>>(opts, opts.size, opts.k, std::move(hasher));
+    } else if(opts.mode == "counting") {
+        switch(opts.counter_bits) {
+            case 2: run_filter<counting_bloom_filter<Hasher, 2>>(opts, opts.size, opts.k, std::move(hasher)); break;
+            case 8: run_filter<counting_bloom_filter<Hasher, 8>>(opts, opts.size, opts.k, std::move(hasher)); break;
+            case 16: run_filter<counting_bloom_filter<Hasher, 16>>(opts, opts.size, opts.k, std::move(hasher)); break;
+            default: run_filter<counting_bloom_filter<Hasher, 4>>(opts, opts.size, opts.k, std::move(hasher)); break;
+        }
+    } else if(opts.concurrent) {
+        run_filter<concurrent_bloom_filter<Hasher>>(opts, opts.size, opts.k, std::move(hasher));
+    } else {
+        run_filter<bloom_filter<Hasher>>(opts, opts.size, opts.k, std::move(hasher));
+    }
 }
 
 int main(int argc, char** argv) {
 
-    if(argc < 4) {
-        std::cout << "Usage: bloomfilter [size] [#hashs] [commands path]" << std::endl;
+    options opts;
+    std::vector<std::string> args;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--hash" && i + 1 < argc) {
+            opts.hash = argv[++i];
+        } else if(arg == "--mode" && i + 1 < argc) {
+            opts.mode = argv[++i];
+        } else if(arg == "--counter-bits" && i + 1 < argc) {
+            opts.counter_bits = std::stoul(argv[++i]);
+        } else if(arg == "--threads" && i + 1 < argc) {
+            opts.threads = std::max(std::stoi(argv[++i]), 1);
+            opts.concurrent = true;
+        } else if(arg == "--time") {
+            opts.time = true;
+        } else if(arg == "--load" && i + 1 < argc) {
+            opts.load = argv[++i];
+        } else if(arg == "--output" && i + 1 < argc) {
+            opts.binary = std::string(argv[++i]) == "binary";
+        } else if(arg == "--verify") {
+            opts.verify = true;
+        } else if(arg == "--items" && i + 1 < argc) {
+            opts.items = std::stoull(argv[++i]);
+        } else if(arg == "--fp" && i + 1 < argc) {
+            opts.fp_rate = std::stod(argv[++i]);
+        } else if(arg == "--seed" && i + 1 < argc) {
+            opts.seeded = true;
+            opts.seed = std::stoull(argv[++i]);
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    // The size and number of hashes are chosen for the caller when a target
+    // false positive rate is given.
+    bool sized = opts.items > 0 || opts.fp_rate > 0;
+
+    // An xor filter is sized by the keys it is built from.
+    bool unsized = opts.mode == "xor";
+
+    if(args.size() < (opts.load.empty() && !sized && !unsized ? 3 : 1)) {
+        std::cout << "Usage: bloomfilter [size] [#hashs] [commands path]\n"
+                  << "       bloomfilter --items N --fp P [commands path]\n"
+                  << "       bloomfilter --load [filter path] [commands path]\n"
+                  << "       bloomfilter --mode xor [commands path]\n"
+                  << "Options: [--hash wyhash|sfold] [--mode classic|blocked|counting|scalable|xor]\n"
+                  << "         [--counter-bits 2|4|8|16] [--threads N] [--seed S] [--verify]\n"
+                  << "         [--output text|binary] [--time]\n"
+                  << "The commands path may be - to read commands from stdin." << std::endl;
         return 0;
     }
 
-    // Size of bloom filter
-    size_t n = std::stoi(argv[1]);
+    if(opts.load.empty() && !sized && !unsized) {
+
+        // Size of bloom filter
+        opts.size = std::stoull(args[0]);
 
-    // Number of hash functions
-    size_t k = std::stoi(argv[2]);
+        // Number of hash functions
+        opts.k = std::stoi(args[1]);
+
+    }
 
     // Path to the running commands
-    std::string path = argv[3];
-
-    // Generate all the primes less than 10,000. This should suffice since k <=
-    // 16 in all our cases.
-    std::vector<size_t> primes = gen_primes(10000);
-    std::vector<hash_ptr> hashers = construct_random_sfold_hashs(k, primes);
-    bloom_filter bf = bloom_filter(n, hashers);
-    
-    run_commands(path, bf);
+    opts.path = args.back();
+
+    if(opts.mode != "classic" && opts.mode != "blocked" && opts.mode != "counting"
+       && opts.mode != "scalable" && opts.mode != "xor") {
+        std::cerr << "Unknown filter mode: " << opts.mode << std::endl;
+        return 1;
+    }
+
+    if(opts.counter_bits != 2 && opts.counter_bits != 4 && opts.counter_bits != 8
+       && opts.counter_bits != 16) {
+        std::cerr << "--counter-bits must be 2, 4, 8 or 16" << std::endl;
+        return 1;
+    }
+
+    if(opts.mode == "scalable" && opts.load.empty() && !sized) {
+        std::cerr << "--mode scalable needs --items and --fp" << std::endl;
+        return 1;
+    }
+
+    // Later filters of a scalable filter make more probes than any fixed set
+    // of sfold seeds provides.
+    if(opts.mode == "scalable" && opts.hash != "wyhash") {
+        std::cerr << "--mode scalable is only supported by the wyhash policy" << std::endl;
+        return 1;
+    }
+
+    // A blocked filter takes its rounds from the high bits of each probe,
+    // which sfold hardly ever sets.
+    if(opts.mode == "blocked" && opts.hash != "wyhash") {
+        std::cerr << "--mode blocked is only supported by the wyhash policy" << std::endl;
+        return 1;
+    }
+
+    // An xor filter takes a single 64-bit hash of each key, and sfold hashes
+    // collide far too often for that.
+    if(opts.mode == "xor" && opts.hash != "wyhash") {
+        std::cerr << "--mode xor is only supported by the wyhash policy" << std::endl;
+        return 1;
+    }
+
+    if(opts.concurrent && opts.mode != "classic") {
+        std::cerr << "--threads is only supported by the classic mode" << std::endl;
+        return 1;
+    }
+
+    if(opts.seeded) {
+        rand_gen::seed(opts.seed);
+    }
+
+    try {
+        if(sized && opts.load.empty() && opts.mode != "scalable" && !unsized) {
+            filter_params params = opts.mode == "blocked"
+                ? filter_params::for_blocked_fp_rate(opts.items, opts.fp_rate)
+                : filter_params::for_fp_rate(opts.items, opts.fp_rate);
+            opts.size = params.bits;
+            opts.k = params.hashes;
+        }
+
+        if(opts.hash == "wyhash") {
+            run(opts, wyhash(opts.seed));
+        } else if(opts.hash == "sfold") {
+            // Generate all the primes less than 10,000, which leaves far more
+            // seeds than any k we sweep over.
+            std::vector<size_t> primes = gen_primes(10000);
+            run(opts, construct_random_sfold_hashs(opts.k, primes));
+        } else {
+            std::cerr << "Unknown hash policy: " << opts.hash << std::endl;
+            return 1;
+        }
+    } catch(const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
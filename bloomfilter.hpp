@@ -0,0 +1,2587 @@
+#ifndef BLOOMFILTER_HPP
+#define BLOOMFILTER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <utility>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <effolkronium/random.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOOMFILTER_X86 1
+#endif
+
+
+/// Random generation library which works without seed boilerplate.
+using rand_gen = effolkronium::random_static;
+
+
+/* Hash policies.
+ *
+ * A hash policy is a template parameter of the bloom filter. Calling the
+ * policy on a key returns a `digest`, and the filter draws its k probe hashes
+ * from that digest with `digest[i]` for i in [0, k). Since the policy is known
+ * at compile time, probing involves no virtual calls and no copies of the key.
+ */
+
+
+/// Fast non-cryptographic 64-bit hash in the style of wyhash. A key is hashed
+/// once and all k probe hashes are derived from that single pass with
+/// Kirsch-Mitzenmacher double hashing.
+class wyhash {
+
+    // The seed mixed into every hash.
+    uint64_t seed;
+
+    // Fixed odd constants used by the mixing rounds.
+    static constexpr uint64_t s0 = 0xa0761d6478bd642full;
+    static constexpr uint64_t s1 = 0xe7037ed1a0b428dbull;
+    static constexpr uint64_t s2 = 0x8ebc6af09c88c6e3ull;
+    static constexpr uint64_t s3 = 0x589965cc75374cc3ull;
+
+    /** Multiplies two 64-bit words into 128 bits and folds the halves
+     * together with xor.
+     */
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        __uint128_t r = (__uint128_t) a * b;
+        return (uint64_t) r ^ (uint64_t) (r >> 64);
+    }
+
+    static uint64_t read8(const char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t read4(const char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    /** Reads 1 to 3 bytes into a single word. */
+    static uint64_t read3(const char* p, size_t len) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        return ((uint64_t) u[0] << 16) | ((uint64_t) u[len >> 1] << 8) | u[len - 1];
+    }
+
+    public:
+
+    /// The probe hashes of one key, h1 + i * h2.
+    struct digest {
+        uint64_t h1;
+        uint64_t h2;
+
+        uint64_t operator[](size_t i) const { return h1 + i * h2; }
+    };
+
+    /** Hashes a block of bytes to 64 bits.
+     *
+     * \param  data Pointer to the first byte of the key.
+     * \param  len  The number of bytes in the key.
+     * \return      The 64-bit hash of the key.
+     */
+    uint64_t hash(const char* data, size_t len) const {
+        const char* p = data;
+        uint64_t h = seed ^ mix(seed ^ s0, s1);
+        uint64_t a, b;
+        if(len <= 16) {
+            if(len >= 4) {
+                a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+                b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+            } else if(len > 0) {
+                a = read3(p, len);
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if(i > 48) {
+                uint64_t h1 = h, h2 = h;
+                do {
+                    h = mix(read8(p) ^ s1, read8(p + 8) ^ h);
+                    h1 = mix(read8(p + 16) ^ s2, read8(p + 24) ^ h1);
+                    h2 = mix(read8(p + 32) ^ s3, read8(p + 40) ^ h2);
+                    p += 48;
+                    i -= 48;
+                } while(i > 48);
+                h ^= h1 ^ h2;
+            }
+            while(i > 16) {
+                h = mix(read8(p) ^ s1, read8(p + 8) ^ h);
+                p += 16;
+                i -= 16;
+            }
+            a = read8(p + i - 16);
+            b = read8(p + i - 8);
+        }
+        return mix(s1 ^ len, mix(a ^ s1, b ^ h));
+    }
+
+    /** Hashes a key once and returns the digest its probes are drawn from.
+     *
+     * \param  key The key to hash.
+     * \return     The digest for the key.
+     */
+    digest operator()(std::string_view key) const {
+        uint64_t h = hash(key.data(), key.size());
+        // The second hash is a remix of the first. It is forced odd so that
+        // successive probes never collapse onto the same index.
+        return digest{h, mix(h ^ s2, s3) | 1};
+    }
+
+    /** Public constructor for the wyhash policy.
+     *
+     * \param seed The seed mixed into every hash.
+     */
+    explicit wyhash(uint64_t seed = 0) : seed(seed) {}
+
+    /// Identifies this policy in saved filter files.
+    static constexpr uint32_t id = 1;
+
+    /// The state needed to rebuild this policy, as saved in filter files.
+    std::vector<uint64_t> state() const { return {seed}; }
+
+    /** Rebuilds the policy from the state saved in a filter file. */
+    static wyhash from_state(const std::vector<uint64_t>& state) {
+        if(state.size() != 1) {
+            throw std::runtime_error("wyhash expects a single seed");
+        }
+        return wyhash(state[0]);
+    }
+
+};
+
+
+/// Legacy string folding hash, kept as a policy with the original algorithm
+/// but without its reads of undefined bytes. Together with the larger pool of
+/// seeds, this means its results differ from those produced before the hash
+/// policies were introduced, both bit for bit and in their false positive
+/// rates. Every probe folds the whole key again with its own seed, so this
+/// policy costs k passes over the key.
+class sfold {
+
+    // One seed per probe. The filter's k must not exceed the number of seeds.
+    std::vector<size_t> seeds;
+
+    public:
+
+    /// The probe hashes of one key, computed lazily so that a failed
+    /// membership test stops folding at the first unset bit.
+    struct digest {
+        const char* data;
+        size_t len;
+        const size_t* seeds;
+
+        uint64_t operator[](size_t i) const { return fold(data, len, seeds[i]); }
+    };
+
+    /** Hash function for the sfold, which operates by handling every 4 bytes of
+     * a string and adding them to a sum. Bytes are offset by the `seed`.
+     * Trailing bytes which do not fill a group of 4 are ignored.
+     */
+    static size_t fold(const char* data, size_t len, size_t seed) {
+        size_t size = len / 4;
+        size_t sum = 0;
+        for(size_t i = 0; i < size; i++) {
+            const char* c = data + i * 4;
+            size_t mult = 1;
+            for(size_t j = 0; j < 4; j++) {
+                sum += c[j] * mult;
+                mult *= seed;
+            }
+        }
+        return sum + 1;
+    }
+
+    /** Returns the digest for a key. No hashing happens until a probe is
+     * requested.
+     *
+     * \param  key The key to hash. It must outlive the digest.
+     * \return     The digest for the key.
+     */
+    digest operator()(std::string_view key) const {
+        return digest{key.data(), key.size(), seeds.data()};
+    }
+
+    /// The number of seeds, and therefore the largest usable k.
+    size_t size() const { return seeds.size(); }
+
+    /** Public constructor for the sfold hash policy. Requires a seed for
+     * every probe.
+     *
+     * \param seeds The seeds for projecting the string, one per probe.
+     */
+    explicit sfold(std::vector<size_t> seeds) : seeds(std::move(seeds)) {}
+
+    /// Identifies this policy in saved filter files.
+    static constexpr uint32_t id = 2;
+
+    /// The state needed to rebuild this policy, as saved in filter files.
+    std::vector<uint64_t> state() const { return std::vector<uint64_t>(seeds.begin(), seeds.end()); }
+
+    /** Rebuilds the policy from the state saved in a filter file. */
+    static sfold from_state(const std::vector<uint64_t>& state) {
+        return sfold(std::vector<size_t>(state.begin(), state.end()));
+    }
+
+};
+
+
+
+/* Saved filters.
+ *
+ * A saved filter file starts with a `filter_header`, followed by the state of
+ * the hash policy as 64-bit words, followed by the words of the filter
+ * starting at a page aligned offset. Loading maps the file instead of reading
+ * it, so a filter is probed straight from the page cache and processes loading
+ * the same file share one copy of it. Files use the byte order of the machine
+ * which saved them.
+ */
+
+
+/// Identifies the layout of the words in a saved filter file.
+enum class filter_layout : uint32_t { classic = 1, blocked = 2, counting = 3, xor8 = 4 };
+
+/** The layout of a counting filter, which also records the width of its
+ * counters in the second byte, so that filters with different counters are
+ * told apart.
+ */
+constexpr filter_layout counting_layout(unsigned bits) {
+    return static_cast<filter_layout>(static_cast<uint32_t>(filter_layout::counting) | bits << 8);
+}
+
+/// Header of a saved filter file.
+struct filter_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t hash;
+    uint32_t k;
+    uint64_t size;
+    uint64_t state_count;
+    uint64_t payload_offset;
+    uint64_t payload_bytes;
+    uint64_t payload_checksum;
+    uint64_t header_checksum;
+};
+
+/// Magic bytes at the start of every saved filter file.
+static const char filter_magic[8] = {'B', 'L', 'O', 'O', 'M', 'F', 'L', 'T'};
+
+/// The current version of the saved filter format.
+constexpr uint32_t filter_version = 1;
+
+/// Alignment of the filter words within a saved file.
+constexpr size_t filter_page = 4096;
+
+/** Computes the checksum of a block of bytes. */
+inline uint64_t checksum(const void* data, size_t len) {
+    return wyhash(0x5eed).hash(static_cast<const char*>(data), len);
+}
+
+/** Computes the checksum of a header and the hash policy state following it,
+ * with the header's own checksum taken as 0.
+ */
+inline uint64_t header_checksum(filter_header header, const std::vector<uint64_t>& state) {
+    header.header_checksum = 0;
+    return checksum(&header, sizeof(header))
+        ^ checksum(state.data(), state.size() * sizeof(uint64_t));
+}
+
+
+/// A private, copy on write mapping of a whole file. Pages are shared with the
+/// page cache until they are written to, and the file itself is never changed.
+class mapped_file {
+
+    // Start of the mapping.
+    char* addr;
+
+    // The length of the mapping in bytes.
+    size_t length;
+
+    void map(int fd, const std::string& name) {
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0) {
+            throw std::runtime_error("cannot map " + name);
+        }
+        length = st.st_size;
+        void* m = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(m == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + name);
+        }
+        addr = static_cast<char*>(m);
+    }
+
+    public:
+
+    char* data() const { return addr; }
+
+    size_t size() const { return length; }
+
+    /** Maps a file.
+     *
+     * \param path The path of the file to map.
+     */
+    explicit mapped_file(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        try {
+            map(fd, path);
+        } catch(...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    /** Maps a file which is already open. The descriptor is left open.
+     *
+     * \param fd   The open file.
+     * \param name The name of the file, used in errors.
+     */
+    mapped_file(int fd, const std::string& name) { map(fd, name); }
+
+    ~mapped_file() { munmap(addr, length); }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+};
+
+
+/// The words of a filter. They are either owned by the filter, or live in the
+/// mapping of a saved filter file.
+template <typename T>
+class filter_storage {
+
+    // The words in use, pointing into either `owned` or `file`.
+    T* words;
+
+    // The number of words.
+    size_t count;
+
+    // Words owned by the storage, empty when mapped.
+    std::vector<T> owned;
+
+    // Mapping holding the words, null when owned.
+    std::shared_ptr<mapped_file> file;
+
+    public:
+
+    T* data() { return words; }
+    const T* data() const { return words; }
+    size_t size() const { return count; }
+
+    T& operator[](size_t i) { return words[i]; }
+    const T& operator[](size_t i) const { return words[i]; }
+
+    /** Allocates `count` zeroed words. */
+    explicit filter_storage(size_t count = 0)
+        : count(count), owned(count, T{}) {
+        words = owned.data();
+    }
+
+    /** Uses `count` words of a mapping, starting at byte `offset`. */
+    filter_storage(std::shared_ptr<mapped_file> file, size_t offset, size_t count)
+        : words(reinterpret_cast<T*>(file->data() + offset)), count(count), file(std::move(file)) {}
+
+    filter_storage(const filter_storage& other)
+        : count(other.count), owned(other.words, other.words + other.count) {
+        words = owned.data();
+    }
+
+    filter_storage(filter_storage&& other) noexcept
+        : words(other.words), count(other.count), owned(std::move(other.owned)),
+          file(std::move(other.file)) {}
+
+    filter_storage& operator=(filter_storage other) noexcept {
+        std::swap(words, other.words);
+        std::swap(count, other.count);
+        std::swap(owned, other.owned);
+        std::swap(file, other.file);
+        return *this;
+    }
+
+};
+
+
+/** Saves a filter to a file. The file is written beside `path` and renamed
+ * over it, so a process which has the old file mapped keeps its copy intact.
+ *
+ * \param path    The path of the file to write.
+ * \param header  The header of the filter. Its layout, hash, k and size must
+ *                be filled in; everything else is filled in here.
+ * \param state   The state of the filter's hash policy.
+ * \param payload The words of the filter.
+ * \param bytes   The number of bytes of words.
+ */
+inline void save_filter(const std::string& path, filter_header header,
+                        const std::vector<uint64_t>& state, const void* payload, size_t bytes) {
+    std::memcpy(header.magic, filter_magic, sizeof(header.magic));
+    header.version = filter_version;
+    header.state_count = state.size();
+    size_t end = sizeof(header) + state.size() * sizeof(uint64_t);
+    header.payload_offset = (end + filter_page - 1) / filter_page * filter_page;
+    header.payload_bytes = bytes;
+    header.payload_checksum = checksum(payload, bytes);
+    header.header_checksum = header_checksum(header, state);
+
+    std::string tmp = path + ".tmp";
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    std::vector<char> padding(header.payload_offset - end, 0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(state.data()), state.size() * sizeof(uint64_t));
+    file.write(padding.data(), padding.size());
+    file.write(static_cast<const char*>(payload), bytes);
+    file.close();
+    if(!file || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+
+/// A saved filter file which has been mapped and checked.
+struct saved_filter {
+    filter_header header;
+    std::vector<uint64_t> state;
+    std::shared_ptr<mapped_file> file;
+};
+
+/** Maps a saved filter file and checks it holds a filter of the expected
+ * layout and hash policy. The header is always checked against its checksum.
+ * The words are only checked when asked to, since that reads all of them.
+ *
+ * \param  path   The path of the file to load.
+ * \param  layout The layout the filter must have.
+ * \param  hash   The id of the hash policy the filter must use.
+ * \param  verify Whether to check the words against their checksum.
+ * \return        The mapped filter.
+ */
+inline saved_filter open_filter(const std::string& path, filter_layout layout, uint32_t hash, bool verify) {
+    saved_filter f;
+    f.file = std::make_shared<mapped_file>(path);
+    const char* data = f.file->data();
+    size_t length = f.file->size();
+
+    if(length < sizeof(filter_header)) {
+        throw std::runtime_error(path + " is not a saved filter");
+    }
+    std::memcpy(&f.header, data, sizeof(filter_header));
+    const filter_header& h = f.header;
+    if(std::memcmp(h.magic, filter_magic, sizeof(h.magic)) != 0) {
+        throw std::runtime_error(path + " is not a saved filter");
+    }
+    if(h.version != filter_version) {
+        throw std::runtime_error(path + " has unsupported version " + std::to_string(h.version));
+    }
+    if(h.state_count > (length - sizeof(filter_header)) / sizeof(uint64_t)
+       || h.payload_offset % filter_page != 0
+       || h.payload_offset > length || h.payload_bytes > length - h.payload_offset) {
+        throw std::runtime_error(path + " is truncated");
+    }
+    f.state.resize(h.state_count);
+    std::memcpy(f.state.data(), data + sizeof(filter_header), h.state_count * sizeof(uint64_t));
+    if(header_checksum(h, f.state) != h.header_checksum) {
+        throw std::runtime_error(path + " has a corrupt header");
+    }
+    if(h.layout != static_cast<uint32_t>(layout) || h.hash != hash) {
+        throw std::runtime_error(path + " holds a filter of a different mode or hash policy");
+    }
+    if(verify && checksum(data + h.payload_offset, h.payload_bytes) != h.payload_checksum) {
+        throw std::runtime_error(path + " has corrupt filter words");
+    }
+    return f;
+}
+
+
+/// The most keys handled by one call of a filter's batch operations, so that
+/// the results of a batch fit in one 64-bit mask.
+constexpr size_t batch_size = 64;
+
+/// The number of keys a batch hashes and prefetches ahead of touching the
+/// filter, so that their cache misses overlap.
+constexpr size_t prefetch_group = 8;
+
+
+/** Returns the mask selecting one of `size` bits when `size` is a power of two
+ * greater than 1, and 0 otherwise.
+ */
+inline size_t pow2_mask(size_t size) {
+    return size > 1 && (size & (size - 1)) == 0 ? size - 1 : 0;
+}
+
+
+/** Selects one of `size` positions from a hash, with `mask` when it is not 0
+ * and with a division otherwise.
+ *
+ * \param  h    The hash.
+ * \param  mask The result of `pow2_mask(size)`.
+ * \param  size The number of positions.
+ * \return      The position.
+ */
+inline size_t select_position(uint64_t h, size_t mask, size_t size) {
+    return mask ? h & mask : h % size;
+}
+
+/** Throws unless two filters have the same size, number of probes and hash
+ * policy state, so that their bits mean the same.
+ */
+template <typename Hasher>
+void check_compatible(size_t size, size_t k, const Hasher& hasher,
+                      size_t other_size, size_t other_k, const Hasher& other_hasher) {
+    if(size != other_size || k != other_k || hasher.state() != other_hasher.state()) {
+        throw std::invalid_argument("filters differ in size, number of hashes or hash seeds");
+    }
+}
+
+
+/* Batched probing.
+ *
+ * Filters whose k probes each select one position share the batch loops
+ * below. Keys are hashed a group at a time and the positions of all their
+ * probes are prefetched before any is touched, so that the cache misses of a
+ * group overlap. A filter supplies how a hash selects a position, the address
+ * holding a position, and how a position is set or tested.
+ */
+
+
+/// The most probes per key whose positions a batch keeps on the stack.
+constexpr size_t max_stack_probes = 32;
+
+/** Storage for the probe positions of one group of keys. Up to
+ * `max_stack_probes` probes per key it lives on the stack, so that batch
+ * calls do not allocate; more fall back to the heap.
+ */
+class probe_scratch {
+
+    // The positions while there are at most `max_stack_probes` per key.
+    size_t stack[prefetch_group * max_stack_probes];
+
+    // The positions when there are more, and empty otherwise.
+    std::vector<size_t> heap;
+
+    public:
+        /// Makes room for the positions of `prefetch_group` keys of k probes.
+        explicit probe_scratch(size_t k) {
+            if(k > max_stack_probes) {
+                heap.resize(prefetch_group * k);
+            }
+        }
+
+        /// The first position of the group.
+        size_t* data() { return heap.empty() ? stack : heap.data(); }
+};
+
+/** Hashes a group of keys, storing the k positions of key i from j[i * k] and
+ * prefetching the address of each, for writing if `Write` is set.
+ */
+template <bool Write, typename Hasher, typename Index, typename Address>
+void hash_probe_group(const Hasher& hasher, size_t k, const std::string_view* keys, size_t m,
+                      size_t* j, Index index, Address address) {
+    for(size_t i = 0; i < m * k; i += k) {
+        typename Hasher::digest d = hasher(keys[i / k]);
+        for(size_t p = 0; p < k; p++) {
+            j[i + p] = index(d[p]);
+            __builtin_prefetch(address(j[i + p]), Write);
+        }
+    }
+}
+
+/** Inserts a batch of keys, calling `set` on the position of every probe.
+ *
+ * \param hasher  The hash policy.
+ * \param k       The number of probes per key.
+ * \param keys    The keys.
+ * \param n       The number of keys.
+ * \param index   Selects the position of a probe hash.
+ * \param address Returns the address holding a position.
+ * \param set     Sets a position.
+ */
+template <typename Hasher, typename Index, typename Address, typename Set>
+void insert_probes(const Hasher& hasher, size_t k, const std::string_view* keys, size_t n,
+                   Index index, Address address, Set set) {
+    probe_scratch scratch(k);
+    size_t* j = scratch.data();
+    for(size_t g = 0; g < n; g += prefetch_group) {
+        size_t m = std::min(prefetch_group, n - g);
+        hash_probe_group<true>(hasher, k, keys + g, m, j, index, address);
+        for(size_t i = 0; i < m * k; i++) {
+            set(j[i]);
+        }
+    }
+}
+
+/** Tests a batch of keys, calling `test` on the positions of each key's
+ * probes until one fails.
+ *
+ * \param  hasher  The hash policy.
+ * \param  k       The number of probes per key.
+ * \param  keys    The keys.
+ * \param  n       The number of keys, at most `batch_size`.
+ * \param  index   Selects the position of a probe hash.
+ * \param  address Returns the address holding a position.
+ * \param  test    Returns whether a position is set.
+ * \return         A mask with bit i set if all probes of keys[i] are set.
+ */
+template <typename Hasher, typename Index, typename Address, typename Test>
+uint64_t test_probes(const Hasher& hasher, size_t k, const std::string_view* keys, size_t n,
+                     Index index, Address address, Test test) {
+    uint64_t found = 0;
+    probe_scratch scratch(k);
+    size_t* j = scratch.data();
+    for(size_t g = 0; g < n; g += prefetch_group) {
+        size_t m = std::min(prefetch_group, n - g);
+        hash_probe_group<false>(hasher, k, keys + g, m, j, index, address);
+        for(size_t i = 0; i < m; i++) {
+            const size_t* probe = &j[i * k];
+            size_t p = 0;
+            while(p < k && test(probe[p])) {
+                p++;
+            }
+            found |= (uint64_t) (p == k) << (g + i);
+        }
+    }
+    return found;
+}
+
+
+/** Expected false positive rate of a classic bloom filter.
+ *
+ * \param  m The number of bits.
+ * \param  k The number of probes per element.
+ * \param  n The number of elements inserted.
+ * \return   The expected false positive rate.
+ */
+inline double classic_fp_rate(double m, double k, double n) {
+    return std::pow(1 - std::exp(-k * n / m), k);
+}
+
+/** Expected false positive rate of a blocked bloom filter. The number of
+ * elements in a block is Poisson distributed, and each of the 8 words of a
+ * block acts as a 64-bit filter receiving one bit per round of every element.
+ *
+ * \param  blocks The number of blocks.
+ * \param  rounds The number of rounds per element.
+ * \param  n      The number of elements inserted.
+ * \return        The expected false positive rate.
+ */
+inline double blocked_fp_rate(double blocks, double rounds, double n) {
+    double lambda = n / blocks;
+    double spread = 10 * std::sqrt(lambda) + 10;
+    double fp = 0;
+    for(double j = std::max(0.0, std::floor(lambda - spread)); j <= lambda + spread; j++) {
+        double p = std::exp(j * std::log(lambda) - lambda - std::lgamma(j + 1));
+        double bit = 1 - std::pow(1 - 1.0 / 64, rounds * j);
+        fp += p * std::pow(bit, 8 * rounds);
+    }
+    return fp;
+}
+
+
+/// The size and number of probes of a bloom filter.
+struct filter_params {
+
+    /// The number of bits.
+    size_t bits;
+
+    /// The number of probes made for every element.
+    size_t hashes;
+
+    /** Chooses the parameters which keep the false positive rate of a filter
+     * holding `items` elements at or below `fp_rate`. The optimal size,
+     * -items * ln(fp_rate) / ln(2)^2, is rounded up to a power of two so
+     * that bits are selected with a mask. The number of probes which is
+     * optimal for that size, bits / items * ln(2), can be nearly twice what
+     * the target needs, since the extra bits already bring the rate below
+     * it. So the fewest probes the optimal size needs, log2(1 / fp_rate)
+     * rounded up, are made instead whenever they meet the target at the
+     * rounded size.
+     *
+     * \param  items   The number of elements the filter is expected to hold.
+     * \param  fp_rate The target false positive rate, in (0, 1).
+     * \return         The parameters.
+     */
+    static filter_params for_fp_rate(size_t items, double fp_rate) {
+        if(items == 0 || !(fp_rate > 0 && fp_rate < 1)) {
+            throw std::invalid_argument("expected items > 0 and a false positive rate in (0, 1)");
+        }
+        const double ln2 = std::log(2.0);
+        double optimal = -(double) items * std::log(fp_rate) / (ln2 * ln2);
+        if(!(optimal <= (double) (std::numeric_limits<size_t>::max() / 2 + 1))) {
+            throw std::invalid_argument("too many items for that false positive rate");
+        }
+        size_t bits = 64;
+        while(bits < optimal) {
+            bits <<= 1;
+        }
+        size_t best = std::max<long>(1, std::lround((double) bits / items * ln2));
+        size_t fewest = std::max<long>(1, std::ceil(-std::log(fp_rate) / ln2));
+        double fewest_rate = std::pow(-std::expm1(-(double) fewest * items / bits), (double) fewest);
+        size_t hashes = fewest < best && fewest_rate <= fp_rate ? fewest : best;
+        return filter_params{bits, hashes};
+    }
+
+    /** Chooses the parameters which keep the false positive rate of a blocked
+     * filter holding `items` elements at or below `fp_rate`. A blocked filter
+     * needs more bits than a classic one, since elements spread unevenly over
+     * its blocks and its probes come in rounds of 8, so the size starts at
+     * that of a classic filter and doubles until a number of rounds, fewest
+     * first, meets the target by `blocked_fp_rate`.
+     *
+     * \param  items   The number of elements the filter is expected to hold.
+     * \param  fp_rate The target false positive rate, in (0, 1).
+     * \return         The parameters.
+     */
+    static filter_params for_blocked_fp_rate(size_t items, double fp_rate) {
+        // The most rounds a blocked filter makes.
+        const size_t max_rounds = 8;
+        for(size_t bits = std::max<size_t>(for_fp_rate(items, fp_rate).bits, 512); bits != 0; bits <<= 1) {
+            for(size_t rounds = 1; rounds <= max_rounds; rounds++) {
+                if(blocked_fp_rate(bits / 512.0, rounds, items) <= fp_rate) {
+                    return filter_params{bits, rounds * 8};
+                }
+            }
+        }
+        throw std::invalid_argument("too many items for that false positive rate");
+    }
+
+};
+
+
+/* Statistics.
+ *
+ * Every filter describes itself as a JSON object through `stats`. The classic
+ * filter can also count its operations and keep histograms of their latency,
+ * but only when built with BLOOMFILTER_STATS defined, so that the hot paths
+ * carry no timing code otherwise.
+ */
+
+
+/// Builds a flat JSON object one field at a time.
+class json_object {
+
+    // The object so far, without its closing brace.
+    std::string text;
+
+    void key(const char* name) {
+        text += text.empty() ? "{\"" : ",\"";
+        text += name;
+        text += "\":";
+    }
+
+    public:
+
+    json_object& field(const char* name, uint64_t value) {
+        key(name);
+        text += std::to_string(value);
+        return *this;
+    }
+
+    /** Adds a number, or null if it is not finite, which JSON cannot hold. */
+    json_object& field(const char* name, double value) {
+        key(name);
+        if(std::isfinite(value)) {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%.6g", value);
+            text += buf;
+        } else {
+            text += "null";
+        }
+        return *this;
+    }
+
+    json_object& field(const char* name, const char* value) {
+        key(name);
+        text += '"';
+        text += value;
+        text += '"';
+        return *this;
+    }
+
+    /** Adds a value which is already JSON, such as a nested object. */
+    json_object& raw(const char* name, const std::string& json) {
+        key(name);
+        text += json;
+        return *this;
+    }
+
+    std::string str() const { return text.empty() ? "{}" : text + "}"; }
+
+};
+
+/** Adds the fill statistics of a bloom filter with `set` of its `bits` bits set
+ * to 1: the fill ratio X / m, the estimated number of elements inserted,
+ * -(m / k) ln(1 - X / m), and the false positive rate expected at that fill,
+ * (X / m)^k. The estimate is null once every bit is set.
+ *
+ * \param json The object to add the statistics to.
+ * \param bits The number of bits, m.
+ * \param set  The number of bits set to 1, X.
+ * \param k    The number of probes made for every element.
+ */
+inline void add_fill_stats(json_object& json, size_t bits, size_t set, size_t k) {
+    double fill = bits ? (double) set / bits : 0;
+    json.field("bits_set", (uint64_t) set)
+        .field("fill_ratio", fill)
+        .field("estimated_items", -(double) bits / k * std::log1p(-fill))
+        .field("expected_fp_rate", std::pow(fill, (double) k));
+}
+
+#ifdef BLOOMFILTER_STATS
+
+/// Counts the elements of one kind of operation and their latency, in buckets
+/// of powers of two nanoseconds. Batches are timed as a whole and every
+/// element of a batch is counted at the batch's mean.
+struct latency_histogram {
+
+    /// The number of buckets. Bucket i holds latencies in [2^i, 2^(i+1)) ns,
+    /// with 0 in the first bucket and everything longer in the last.
+    static constexpr size_t buckets = 24;
+
+    /// The number of elements operated on.
+    uint64_t count = 0;
+
+    /// The number of elements in each bucket.
+    uint64_t bucket[buckets] = {};
+
+    /** Records an operation on `n` elements which took `ns` nanoseconds. */
+    void record(uint64_t ns, uint64_t n) {
+        uint64_t mean = ns / n;
+        size_t b = mean ? 63 - __builtin_clzll(mean) : 0;
+        count += n;
+        bucket[std::min(b, buckets - 1)] += n;
+    }
+
+    std::string json() const {
+        std::string hist;
+        for(size_t b = 0; b < buckets; b++) {
+            hist += (b ? "," : "") + std::to_string(bucket[b]);
+        }
+        return json_object().field("count", count).raw("ns_log2_buckets", "[" + hist + "]").str();
+    }
+
+};
+
+/// Times an operation on a number of elements, recording it into a histogram
+/// when it goes out of scope.
+class latency_timer {
+
+    latency_histogram& histogram;
+    uint64_t n;
+    std::chrono::steady_clock::time_point start;
+
+    public:
+
+    latency_timer(latency_histogram& histogram, size_t n)
+        : histogram(histogram), n(n), start(std::chrono::steady_clock::now()) {}
+
+    ~latency_timer() {
+        if(n) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            histogram.record(ns, n);
+        }
+    }
+
+    latency_timer(const latency_timer&) = delete;
+    latency_timer& operator=(const latency_timer&) = delete;
+
+};
+
+#endif
+
+
+/// Class implementation for the bloom filter data structure.
+template <typename Hasher = wyhash>
+class bloom_filter {
+
+    private:
+
+        // Bit set for checking if an element occupies the set, packed into
+        // 64-bit words.
+        filter_storage<uint64_t> words;
+
+        // The number of bits in the set.
+        size_t size;
+
+        // Mask selecting a bit when the size is a power of two, otherwise 0,
+        // in which case a bit is selected with a division.
+        size_t mask;
+
+        // The number of probes made for every element.
+        size_t k;
+
+        // Hash policy which produces the probes for an element.
+        Hasher hasher;
+
+        // The number of bits set to 1, counted as they are set. A loaded
+        // filter counts its bits the first time they are asked for.
+        mutable size_t set_count = 0;
+        mutable bool set_counted = true;
+
+#ifdef BLOOMFILTER_STATS
+        // Inserts and tests since the filter was built or loaded.
+        latency_histogram inserts;
+        mutable latency_histogram queries;
+#endif
+
+        size_t index(uint64_t h) const { return select_position(h, mask, size); }
+
+        void set_bit(size_t j) {
+            uint64_t& w = words[j >> 6];
+            uint64_t bit = 1ull << (j & 63);
+            set_count += !(w & bit);
+            w |= bit;
+        }
+
+
+
+    public:
+
+        /** Inserts an element into the bloom filter by hashing it once and
+         * setting the bit of each of its k probes to 1 in the bit set.
+         *
+         * \param str The string to insert into the bloom filter
+         */
+        void insert(std::string_view str) {
+#ifdef BLOOMFILTER_STATS
+            latency_timer timer(inserts, 1);
+#endif
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                set_bit(index(d[i]));
+            }
+        }
+
+        /** Tests if a string is in the bloom filter by hashing it once and
+         * checking the bits of all its k probes are 1 in the bit set.
+         *
+         * \param  str The string to test for membership
+         * \return     True if the string is in the set, false otherwise.
+         */
+        bool test_membership(std::string_view str) const {
+#ifdef BLOOMFILTER_STATS
+            latency_timer timer(queries, 1);
+#endif
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                size_t j = index(d[i]);
+                if(!(words[j >> 6] & (1ull << (j & 63)))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /** Inserts a batch of elements. Keys are hashed a group at a time and
+         * the words of all their probes are prefetched before any is set.
+         *
+         * \param keys The strings to insert into the bloom filter.
+         * \param n    The number of strings.
+         */
+        void insert_batch(const std::string_view* keys, size_t n) {
+#ifdef BLOOMFILTER_STATS
+            latency_timer timer(inserts, n);
+#endif
+            insert_probes(hasher, k, keys, n,
+                          [this](uint64_t h) { return index(h); },
+                          [this](size_t j) { return &words[j >> 6]; },
+                          [this](size_t j) { set_bit(j); });
+        }
+
+        /** Tests a batch of elements for membership. Keys are hashed a group
+         * at a time and the words of all their probes are prefetched before
+         * any is tested.
+         *
+         * \param  keys The strings to test for membership.
+         * \param  n    The number of strings, at most `batch_size`.
+         * \return      A mask with bit i set if keys[i] is in the set.
+         */
+        uint64_t test_membership_batch(const std::string_view* keys, size_t n) const {
+#ifdef BLOOMFILTER_STATS
+            latency_timer timer(queries, n);
+#endif
+            return test_probes(hasher, k, keys, n,
+                               [this](uint64_t h) { return index(h); },
+                               [this](size_t j) { return &words[j >> 6]; },
+                               [this](size_t j) { return (words[j >> 6] >> (j & 63)) & 1; });
+        }
+
+        /// The number of bits in the filter.
+        size_t bits() const { return size; }
+
+        /// The number of probes made for every element.
+        size_t hashes() const { return k; }
+
+        /// The number of bits set to 1.
+        size_t bits_set() const {
+            if(!set_counted) {
+                set_count = 0;
+                for(size_t i = 0; i < words.size(); i++) {
+                    set_count += __builtin_popcountll(words[i]);
+                }
+                set_counted = true;
+            }
+            return set_count;
+        }
+
+        /// The fraction of bits set to 1.
+        double fill_ratio() const { return (double) bits_set() / size; }
+
+        /** Describes the filter as a JSON object: its size, fill, estimated
+         * number of elements and expected false positive rate, and, when
+         * built with BLOOMFILTER_STATS, its operation counts and latencies.
+         */
+        std::string stats() const {
+            json_object json;
+            json.field("mode", "classic").field("bits", (uint64_t) size).field("hashes", (uint64_t) k);
+            add_fill_stats(json, size, bits_set(), k);
+#ifdef BLOOMFILTER_STATS
+            json.raw("inserts", inserts.json()).raw("queries", queries.json());
+#endif
+            return json.str();
+        }
+
+        /** Adds every element of another filter by or-ing its words into
+         * this one, so that filters built from shards of a key set merge into
+         * the filter of the whole set.
+         *
+         * \param other A filter of the same size, number of probes and hash
+         *              policy state.
+         */
+        void unite(const bloom_filter& other) {
+            check_compatible(size, k, hasher, other.size, other.k, other.hasher);
+            for(size_t i = 0; i < words.size(); i++) {
+                words[i] |= other.words[i];
+            }
+            set_counted = false;
+        }
+
+        /** Keeps only the bits set in both this filter and another by and-ing
+         * their words. Every element of both sets is still found, but the
+         * false positive rate can be higher than that of a filter built from
+         * the common elements alone.
+         *
+         * \param other A filter of the same size, number of probes and hash
+         *              policy state.
+         */
+        void intersect(const bloom_filter& other) {
+            check_compatible(size, k, hasher, other.size, other.k, other.hasher);
+            for(size_t i = 0; i < words.size(); i++) {
+                words[i] &= other.words[i];
+            }
+            set_counted = false;
+        }
+
+        /** Resets the bitset to all 0's.  */
+        void reset() {
+            std::fill(words.data(), words.data() + words.size(), 0);
+            set_count = 0;
+            set_counted = true;
+        };
+
+        /** Saves the bloom filter to a file which `load` can map back in.
+         *
+         * \param path The path of the file to write.
+         */
+        void save(const std::string& path) const {
+            filter_header header = {};
+            header.layout = static_cast<uint32_t>(filter_layout::classic);
+            header.hash = Hasher::id;
+            header.k = k;
+            header.size = size;
+            save_filter(path, header, hasher.state(), words.data(), words.size() * sizeof(uint64_t));
+        }
+
+        /** Loads a bloom filter saved by `save`. The words are mapped rather
+         * than read, and only copied as they are written to.
+         *
+         * \param  path   The path of the file to load.
+         * \param  verify Whether to check the words against their checksum.
+         * \return        The loaded bloom filter.
+         */
+        static bloom_filter load(const std::string& path, bool verify = false) {
+            saved_filter f = open_filter(path, filter_layout::classic, Hasher::id, verify);
+            size_t count = (f.header.size + 63) / 64;
+            if(f.header.size == 0 || f.header.payload_bytes != count * sizeof(uint64_t)) {
+                throw std::runtime_error(path + " has the wrong number of words");
+            }
+            return bloom_filter(filter_storage<uint64_t>(f.file, f.header.payload_offset, count),
+                                f.header.size, f.header.k, Hasher::from_state(f.state));
+        }
+
+        /** Initializes the bloom filter.
+         *
+         * \param size   The maximum size of the bitset and corresponding
+         *               index.
+         * \param k      The number of probes made for every element.
+         * \param hasher The hash policy producing the probes.
+         */
+        bloom_filter(size_t size, size_t k, Hasher hasher = Hasher())
+            : words((size + 63) / 64), size(size), mask(pow2_mask(size)), k(k),
+              hasher(std::move(hasher)) {};
+
+        /** Initializes the bloom filter with parameters chosen by
+         * `filter_params::for_fp_rate`.
+         *
+         * \param params The size and number of probes.
+         * \param hasher The hash policy producing the probes.
+         */
+        explicit bloom_filter(const filter_params& params, Hasher hasher = Hasher())
+            : bloom_filter(params.bits, params.hashes, std::move(hasher)) {};
+
+    private:
+
+        /** Initializes the bloom filter over existing words. */
+        bloom_filter(filter_storage<uint64_t> words, size_t size, size_t k, Hasher hasher)
+            : words(std::move(words)), size(size), mask(pow2_mask(size)), k(k),
+              hasher(std::move(hasher)), set_counted(false) {};
+
+};
+
+
+/// One cache line of the blocked bloom filter.
+struct alignas(64) bloom_block {
+    uint64_t words[8];
+};
+
+
+/* Block kernels.
+ *
+ * Every round of the blocked filter takes a 32-bit hash and sets one bit in
+ * each of the 8 words of a block. Bit j comes from multiplying the hash by the
+ * j-th salt and keeping the top 6 bits. All kernels compute identical masks, so
+ * which one runs only changes the speed.
+ */
+
+
+/// Odd multipliers spreading one 32-bit hash over the 8 words of a block.
+alignas(32) static const uint32_t block_salts[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+/** Builds the combined mask of all rounds, one word at a time.
+ *
+ * \param h      The 32-bit hash of every round.
+ * \param rounds The number of rounds.
+ * \param mask   The 8 words of the mask, overwritten.
+ */
+inline void block_mask_scalar(const uint32_t* h, size_t rounds, uint64_t* mask) {
+    for(size_t j = 0; j < 8; j++) {
+        mask[j] = 0;
+    }
+    for(size_t r = 0; r < rounds; r++) {
+        for(size_t j = 0; j < 8; j++) {
+            mask[j] |= 1ull << ((uint32_t) (h[r] * block_salts[j]) >> 26);
+        }
+    }
+}
+
+inline void block_insert_scalar(bloom_block& b, const uint32_t* h, size_t rounds) {
+    uint64_t mask[8];
+    block_mask_scalar(h, rounds, mask);
+    for(size_t j = 0; j < 8; j++) {
+        b.words[j] |= mask[j];
+    }
+}
+
+inline bool block_test_scalar(const bloom_block& b, const uint32_t* h, size_t rounds) {
+    uint64_t mask[8];
+    block_mask_scalar(h, rounds, mask);
+    for(size_t j = 0; j < 8; j++) {
+        if((b.words[j] & mask[j]) != mask[j]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef BLOOMFILTER_X86
+
+/// SSE2 is part of every x86-64 target, so this kernel only vectorizes the
+/// memory side; the mask is still built a word at a time.
+inline void block_insert_sse2(bloom_block& b, const uint32_t* h, size_t rounds) {
+    alignas(16) uint64_t mask[8];
+    block_mask_scalar(h, rounds, mask);
+    for(size_t j = 0; j < 8; j += 2) {
+        __m128i* w = reinterpret_cast<__m128i*>(b.words + j);
+        __m128i m = _mm_load_si128(reinterpret_cast<const __m128i*>(mask + j));
+        _mm_store_si128(w, _mm_or_si128(_mm_load_si128(w), m));
+    }
+}
+
+inline bool block_test_sse2(const bloom_block& b, const uint32_t* h, size_t rounds) {
+    alignas(16) uint64_t mask[8];
+    block_mask_scalar(h, rounds, mask);
+    __m128i missing = _mm_setzero_si128();
+    for(size_t j = 0; j < 8; j += 2) {
+        __m128i w = _mm_load_si128(reinterpret_cast<const __m128i*>(b.words + j));
+        __m128i m = _mm_load_si128(reinterpret_cast<const __m128i*>(mask + j));
+        missing = _mm_or_si128(missing, _mm_andnot_si128(w, m));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(missing, _mm_setzero_si128())) == 0xffff;
+}
+
+/** Builds the combined mask of all rounds as two 256-bit halves, covering
+ * words 0-3 and 4-7 of the block.
+ */
+__attribute__((target("avx2")))
+inline void block_mask_avx2(const uint32_t* h, size_t rounds, __m256i& lo, __m256i& hi) {
+    const __m256i salt = _mm256_load_si256(reinterpret_cast<const __m256i*>(block_salts));
+    const __m256i one = _mm256_set1_epi64x(1);
+    lo = _mm256_setzero_si256();
+    hi = _mm256_setzero_si256();
+    for(size_t r = 0; r < rounds; r++) {
+        __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h[r]), salt), 26);
+        lo = _mm256_or_si256(lo, _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits))));
+        hi = _mm256_or_si256(hi, _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits, 1))));
+    }
+}
+
+__attribute__((target("avx2")))
+inline void block_insert_avx2(bloom_block& b, const uint32_t* h, size_t rounds) {
+    __m256i lo, hi;
+    block_mask_avx2(h, rounds, lo, hi);
+    __m256i* w = reinterpret_cast<__m256i*>(b.words);
+    _mm256_store_si256(w, _mm256_or_si256(_mm256_load_si256(w), lo));
+    _mm256_store_si256(w + 1, _mm256_or_si256(_mm256_load_si256(w + 1), hi));
+}
+
+__attribute__((target("avx2")))
+inline bool block_test_avx2(const bloom_block& b, const uint32_t* h, size_t rounds) {
+    __m256i lo, hi;
+    block_mask_avx2(h, rounds, lo, hi);
+    const __m256i* w = reinterpret_cast<const __m256i*>(b.words);
+    return _mm256_testc_si256(_mm256_load_si256(w), lo)
+        & _mm256_testc_si256(_mm256_load_si256(w + 1), hi);
+}
+
+#endif
+
+/// The block kernel chosen for the running CPU.
+enum class block_kernel { scalar, sse2, avx2 };
+
+/** Picks the fastest block kernel the running CPU supports. */
+inline block_kernel detect_block_kernel() {
+#ifdef BLOOMFILTER_X86
+    if(__builtin_cpu_supports("avx2")) {
+        return block_kernel::avx2;
+    }
+    return block_kernel::sse2;
+#else
+    return block_kernel::scalar;
+#endif
+}
+
+
+/// Class implementation for the blocked (split block) bloom filter. All probes
+/// of an element land in one 64-byte block, so an operation touches a single
+/// cache line no matter how many probes are made.
+template <typename Hasher = wyhash>
+class blocked_bloom_filter {
+
+    public:
+
+        /// The most rounds, and so 8 * max_rounds probes, made per element.
+        static constexpr size_t max_rounds = 8;
+
+    private:
+
+        // Cache aligned blocks of the filter. Their count is a power of two.
+        filter_storage<bloom_block> blocks;
+
+        // Mask selecting a block from a hash.
+        size_t block_mask;
+
+        // The number of rounds made for every element, each setting 8 bits.
+        size_t rounds;
+
+        // Hash policy which produces the probes for an element.
+        Hasher hasher;
+
+        // The kernel used to set and test blocks.
+        block_kernel kernel;
+
+        /** Hashes an element, returning its block and filling in the 32-bit
+         * hash of each round. The block comes from the low bits of the first
+         * probe and the rounds from the high bits of each probe.
+         */
+        size_t locate(std::string_view str, uint32_t* h) const {
+            typename Hasher::digest d = hasher(str);
+            for(size_t r = 0; r < rounds; r++) {
+                h[r] = (uint32_t) (d[r] >> 32);
+            }
+            return d[0] & block_mask;
+        }
+
+        /** Sets the bits of all rounds in a block with the chosen kernel. */
+        void set_block(bloom_block& b, const uint32_t* h) {
+            switch(kernel) {
+#ifdef BLOOMFILTER_X86
+                case block_kernel::avx2: block_insert_avx2(b, h, rounds); break;
+                case block_kernel::sse2: block_insert_sse2(b, h, rounds); break;
+#endif
+                default: block_insert_scalar(b, h, rounds); break;
+            }
+        }
+
+        /** Tests the bits of all rounds in a block with the chosen kernel. */
+        bool test_block(const bloom_block& b, const uint32_t* h) const {
+            switch(kernel) {
+#ifdef BLOOMFILTER_X86
+                case block_kernel::avx2: return block_test_avx2(b, h, rounds);
+                case block_kernel::sse2: return block_test_sse2(b, h, rounds);
+#endif
+                default: return block_test_scalar(b, h, rounds);
+            }
+        }
+
+
+
+    public:
+
+        /** Inserts an element into the bloom filter by setting the bits of all
+         * its rounds in its block.
+         *
+         * \param str The string to insert into the bloom filter
+         */
+        void insert(std::string_view str) {
+            uint32_t h[max_rounds];
+            set_block(blocks[locate(str, h)], h);
+        }
+
+        /** Tests if a string is in the bloom filter by checking the bits of
+         * all its rounds are 1 in its block.
+         *
+         * \param  str The string to test for membership
+         * \return     True if the string is in the set, false otherwise.
+         */
+        bool test_membership(std::string_view str) const {
+            uint32_t h[max_rounds];
+            return test_block(blocks[locate(str, h)], h);
+        }
+
+        /** Inserts a batch of elements. Keys are hashed a group at a time and
+         * all their blocks are prefetched before any is set.
+         *
+         * \param keys The strings to insert into the bloom filter.
+         * \param n    The number of strings.
+         */
+        void insert_batch(const std::string_view* keys, size_t n) {
+            size_t b[prefetch_group];
+            uint32_t h[prefetch_group][max_rounds];
+            for(size_t g = 0; g < n; g += prefetch_group) {
+                size_t m = std::min(prefetch_group, n - g);
+                for(size_t i = 0; i < m; i++) {
+                    b[i] = locate(keys[g + i], h[i]);
+                    __builtin_prefetch(&blocks[b[i]], 1);
+                }
+                for(size_t i = 0; i < m; i++) {
+                    set_block(blocks[b[i]], h[i]);
+                }
+            }
+        }
+
+        /** Tests a batch of elements for membership. Keys are hashed a group
+         * at a time and all their blocks are prefetched before any is tested.
+         *
+         * \param  keys The strings to test for membership.
+         * \param  n    The number of strings, at most `batch_size`.
+         * \return      A mask with bit i set if keys[i] is in the set.
+         */
+        uint64_t test_membership_batch(const std::string_view* keys, size_t n) const {
+            uint64_t found = 0;
+            size_t b[prefetch_group];
+            uint32_t h[prefetch_group][max_rounds];
+            for(size_t g = 0; g < n; g += prefetch_group) {
+                size_t m = std::min(prefetch_group, n - g);
+                for(size_t i = 0; i < m; i++) {
+                    b[i] = locate(keys[g + i], h[i]);
+                    __builtin_prefetch(&blocks[b[i]], 0);
+                }
+                for(size_t i = 0; i < m; i++) {
+                    found |= (uint64_t) test_block(blocks[b[i]], h[i]) << (g + i);
+                }
+            }
+            return found;
+        }
+
+        /// The number of bits in the filter.
+        size_t bits() const { return blocks.size() * 512; }
+
+        /// The number of probes made for every element, 8 per round.
+        size_t hashes() const { return rounds * 8; }
+
+        /** Describes the filter as a JSON object. The bits set are counted
+         * on every call. The estimates assume bits are spread over the whole
+         * filter, so they are only approximate for a blocked filter.
+         */
+        std::string stats() const {
+            size_t set = 0;
+            for(size_t i = 0; i < blocks.size(); i++) {
+                for(uint64_t w : blocks[i].words) {
+                    set += __builtin_popcountll(w);
+                }
+            }
+            json_object json;
+            json.field("mode", "blocked").field("bits", (uint64_t) bits()).field("hashes", (uint64_t) hashes());
+            add_fill_stats(json, bits(), set, hashes());
+            return json.str();
+        }
+
+        /** Adds every element of another filter by or-ing its blocks into
+         * this one.
+         *
+         * \param other A filter of the same size, number of probes and hash
+         *              policy state.
+         */
+        void unite(const blocked_bloom_filter& other) {
+            check_compatible(blocks.size(), rounds, hasher,
+                             other.blocks.size(), other.rounds, other.hasher);
+            for(size_t i = 0; i < blocks.size(); i++) {
+                for(size_t j = 0; j < 8; j++) {
+                    blocks[i].words[j] |= other.blocks[i].words[j];
+                }
+            }
+        }
+
+        /** Keeps only the bits set in both this filter and another by and-ing
+         * their blocks. Every element of both sets is still found.
+         *
+         * \param other A filter of the same size, number of probes and hash
+         *              policy state.
+         */
+        void intersect(const blocked_bloom_filter& other) {
+            check_compatible(blocks.size(), rounds, hasher,
+                             other.blocks.size(), other.rounds, other.hasher);
+            for(size_t i = 0; i < blocks.size(); i++) {
+                for(size_t j = 0; j < 8; j++) {
+                    blocks[i].words[j] &= other.blocks[i].words[j];
+                }
+            }
+        }
+
+        /** Resets every block to all 0's.  */
+        void reset() { std::fill(blocks.data(), blocks.data() + blocks.size(), bloom_block{}); };
+
+        /** Saves the bloom filter to a file which `load` can map back in.
+         *
+         * \param path The path of the file to write.
+         */
+        void save(const std::string& path) const {
+            filter_header header = {};
+            header.layout = static_cast<uint32_t>(filter_layout::blocked);
+            header.hash = Hasher::id;
+            header.k = rounds * 8;
+            header.size = blocks.size() * 512;
+            save_filter(path, header, hasher.state(), blocks.data(), blocks.size() * sizeof(bloom_block));
+        }
+
+        /** Loads a bloom filter saved by `save`. The blocks are mapped rather
+         * than read, and only copied as they are written to.
+         *
+         * \param  path   The path of the file to load.
+         * \param  verify Whether to check the blocks against their checksum.
+         * \return        The loaded bloom filter.
+         */
+        static blocked_bloom_filter load(const std::string& path, bool verify = false) {
+            saved_filter f = open_filter(path, filter_layout::blocked, Hasher::id, verify);
+            size_t count = f.header.size / 512;
+            if(count == 0 || (count & (count - 1)) != 0
+               || f.header.payload_bytes != count * sizeof(bloom_block)) {
+                throw std::runtime_error(path + " has the wrong number of blocks");
+            }
+            blocked_bloom_filter bf(0, f.header.k, Hasher::from_state(f.state));
+            bf.blocks = filter_storage<bloom_block>(f.file, f.header.payload_offset, count);
+            bf.block_mask = count - 1;
+            return bf;
+        }
+
+        /** Initializes the blocked bloom filter.
+         *
+         * \param size   The minimum number of bits in the filter. It is
+         *               rounded up to a power of two number of blocks.
+         * \param k      The number of probes made for every element. Every
+         *               round sets 8 bits, so k is rounded up to a multiple
+         *               of 8, and capped at 8 * max_rounds.
+         * \param hasher The hash policy producing the probes. It must provide
+         *               at least ceil(k / 8) probes.
+         */
+        blocked_bloom_filter(size_t size, size_t k, Hasher hasher = Hasher())
+            : hasher(std::move(hasher)), kernel(detect_block_kernel()) {
+            size_t count = 1;
+            while(count * 512 < size) {
+                count <<= 1;
+            }
+            blocks = filter_storage<bloom_block>(count);
+            block_mask = count - 1;
+            rounds = std::min(std::max<size_t>((k + 7) / 8, 1), max_rounds);
+        };
+
+        /** Initializes the blocked bloom filter with parameters chosen by
+         * `filter_params::for_blocked_fp_rate`. Blocking raises the false
+         * positive rate above that of a classic filter of the same size, so
+         * parameters chosen by `filter_params::for_fp_rate` miss their target.
+         *
+         * \param params The size and number of probes.
+         * \param hasher The hash policy producing the probes.
+         */
+        explicit blocked_bloom_filter(const filter_params& params, Hasher hasher = Hasher())
+            : blocked_bloom_filter(params.bits, params.hashes, std::move(hasher)) {};
+
+};
+
+
+/// Class implementation for a bloom filter which may be inserted into and
+/// tested from many threads at once. It probes exactly like `bloom_filter`, so
+/// both give the same answers for the same commands.
+template <typename Hasher = wyhash>
+class concurrent_bloom_filter {
+
+    private:
+
+        // Bit set for checking if an element occupies the set, packed into
+        // atomic 64-bit words.
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+        // The number of bits in the set.
+        size_t size;
+
+        // Mask selecting a bit when the size is a power of two, otherwise 0.
+        size_t mask;
+
+        // The number of probes made for every element.
+        size_t k;
+
+        // Hash policy which produces the probes for an element.
+        Hasher hasher;
+
+        /** Sets a bit. The word is read first so that bits which are already
+         * set, the common case in a loaded filter, never take the cache line
+         * away from other threads.
+         */
+        void set_bit(size_t j) {
+            std::atomic<uint64_t>& w = words[j >> 6];
+            uint64_t bit = 1ull << (j & 63);
+            if(!(w.load(std::memory_order_relaxed) & bit)) {
+                w.fetch_or(bit, std::memory_order_relaxed);
+            }
+        }
+
+        size_t index(uint64_t h) const { return select_position(h, mask, size); }
+
+        bool test_bit(size_t j) const {
+            return words[j >> 6].load(std::memory_order_relaxed) & (1ull << (j & 63));
+        }
+
+
+
+    public:
+
+        /** Inserts an element into the bloom filter by hashing it once and
+         * setting the bit of each of its k probes to 1 in the bit set. Safe to
+         * call from many threads at once.
+         *
+         * \param str The string to insert into the bloom filter
+         */
+        void insert(std::string_view str) {
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                set_bit(index(d[i]));
+            }
+        }
+
+        /** Tests if a string is in the bloom filter by hashing it once and
+         * checking the bits of all its k probes are 1 in the bit set. Safe to
+         * call from many threads at once. A test racing with the insert of the
+         * same element may see only some of its bits.
+         *
+         * \param  str The string to test for membership
+         * \return     True if the string is in the set, false otherwise.
+         */
+        bool test_membership(std::string_view str) const {
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                if(!test_bit(index(d[i]))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /** Inserts a batch of elements, prefetching the words of a group of
+         * keys before any is set.
+         *
+         * \param keys The strings to insert into the bloom filter.
+         * \param n    The number of strings.
+         */
+        void insert_batch(const std::string_view* keys, size_t n) {
+            insert_probes(hasher, k, keys, n,
+                          [this](uint64_t h) { return index(h); },
+                          [this](size_t j) { return &words[j >> 6]; },
+                          [this](size_t j) { set_bit(j); });
+        }
+
+        /** Tests a batch of elements for membership, prefetching the words of
+         * a group of keys before any is tested.
+         *
+         * \param  keys The strings to test for membership.
+         * \param  n    The number of strings, at most `batch_size`.
+         * \return      A mask with bit i set if keys[i] is in the set.
+         */
+        uint64_t test_membership_batch(const std::string_view* keys, size_t n) const {
+            return test_probes(hasher, k, keys, n,
+                               [this](uint64_t h) { return index(h); },
+                               [this](size_t j) { return &words[j >> 6]; },
+                               [this](size_t j) { return test_bit(j); });
+        }
+
+        /// The number of bits in the filter.
+        size_t bits() const { return size; }
+
+        /// The number of probes made for every element.
+        size_t hashes() const { return k; }
+
+        /** Describes the filter as a JSON object. The bits set are counted
+         * on every call, so it must not run alongside inserts.
+         */
+        std::string stats() const {
+            size_t set = 0;
+            for(size_t i = 0; i < (size + 63) / 64; i++) {
+                set += __builtin_popcountll(words[i].load(std::memory_order_relaxed));
+            }
+            json_object json;
+            json.field("mode", "classic").field("bits", (uint64_t) size).field("hashes", (uint64_t) k);
+            add_fill_stats(json, size, set, k);
+            return json.str();
+        }
+
+        /** Adds every element of another filter by or-ing its words into
+         * this one. Safe to run alongside inserts and tests.
+         *
+         * \param other A filter of the same size, number of probes and hash
+         *              policy state.
+         */
+        void unite(const concurrent_bloom_filter& other) {
+            check_compatible(size, k, hasher, other.size, other.k, other.hasher);
+            for(size_t i = 0; i < (size + 63) / 64; i++) {
+                words[i].fetch_or(other.words[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+        }
+
+        /** Keeps only the bits set in both this filter and another by and-ing
+         * their words. Every element of both sets is still found. Must not run
+         * alongside inserts.
+         *
+         * \param other A filter of the same size, number of probes and hash
+         *              policy state.
+         */
+        void intersect(const concurrent_bloom_filter& other) {
+            check_compatible(size, k, hasher, other.size, other.k, other.hasher);
+            for(size_t i = 0; i < (size + 63) / 64; i++) {
+                words[i].fetch_and(other.words[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+        }
+
+        /** Resets the bitset to all 0's. Must not run alongside other
+         * operations.
+         */
+        void reset() {
+            for(size_t i = 0; i < (size + 63) / 64; i++) {
+                words[i].store(0, std::memory_order_relaxed);
+            }
+        };
+
+        /** Saves the bloom filter to a file which `load` can read back in. It
+         * is saved with the classic layout, so either class can load it. Must
+         * not run alongside inserts.
+         *
+         * \param path The path of the file to write.
+         */
+        void save(const std::string& path) const {
+            std::vector<uint64_t> copy((size + 63) / 64);
+            for(size_t i = 0; i < copy.size(); i++) {
+                copy[i] = words[i].load(std::memory_order_relaxed);
+            }
+            filter_header header = {};
+            header.layout = static_cast<uint32_t>(filter_layout::classic);
+            header.hash = Hasher::id;
+            header.k = k;
+            header.size = size;
+            save_filter(path, header, hasher.state(), copy.data(), copy.size() * sizeof(uint64_t));
+        }
+
+        /** Loads a bloom filter saved with the classic layout. Unlike the
+         * other filters, the words are copied out of the file, since they must
+         * be atomics.
+         *
+         * \param  path   The path of the file to load.
+         * \param  verify Whether to check the words against their checksum.
+         * \return        The loaded bloom filter.
+         */
+        static concurrent_bloom_filter load(const std::string& path, bool verify = false) {
+            saved_filter f = open_filter(path, filter_layout::classic, Hasher::id, verify);
+            size_t count = (f.header.size + 63) / 64;
+            if(f.header.size == 0 || f.header.payload_bytes != count * sizeof(uint64_t)) {
+                throw std::runtime_error(path + " has the wrong number of words");
+            }
+            concurrent_bloom_filter bf(f.header.size, f.header.k, Hasher::from_state(f.state));
+            const char* payload = f.file->data() + f.header.payload_offset;
+            for(size_t i = 0; i < count; i++) {
+                uint64_t w;
+                std::memcpy(&w, payload + i * sizeof(uint64_t), sizeof(w));
+                bf.words[i].store(w, std::memory_order_relaxed);
+            }
+            return bf;
+        }
+
+        /** Initializes the bloom filter.
+         *
+         * \param size   The maximum size of the bitset and corresponding
+         *               index.
+         * \param k      The number of probes made for every element.
+         * \param hasher The hash policy producing the probes.
+         */
+        concurrent_bloom_filter(size_t size, size_t k, Hasher hasher = Hasher())
+            : words(new std::atomic<uint64_t>[(size + 63) / 64]), size(size), mask(pow2_mask(size)),
+              k(k), hasher(std::move(hasher)) {
+            reset();
+        };
+
+        /** Initializes the bloom filter with parameters chosen by
+         * `filter_params::for_fp_rate`.
+         *
+         * \param params The size and number of probes.
+         * \param hasher The hash policy producing the probes.
+         */
+        explicit concurrent_bloom_filter(const filter_params& params, Hasher hasher = Hasher())
+            : concurrent_bloom_filter(params.bits, params.hashes, std::move(hasher)) {};
+
+};
+
+
+/// Class implementation for the counting bloom filter, which can remove
+/// elements as well as insert them. Every bit of a classic filter becomes a
+/// saturating counter of `Bits` bits, packed into 64-bit words so that no
+/// counter straddles two. A counter which reaches its maximum stays there,
+/// since how many elements it counts is no longer known; removing those
+/// elements leaves it set, which can only cause false positives.
+template <typename Hasher = wyhash, unsigned Bits = 4>
+class counting_bloom_filter {
+
+    static_assert(Bits == 2 || Bits == 4 || Bits == 8 || Bits == 16,
+                  "counters must be 2, 4, 8 or 16 bits wide");
+
+    public:
+
+        /// The number of bits in a counter.
+        static constexpr unsigned counter_bits = Bits;
+
+        /// The value at which a counter saturates.
+        static constexpr uint64_t max_count = (1ull << Bits) - 1;
+
+    private:
+
+        // The number of counters packed into a word.
+        static constexpr size_t per_word = 64 / Bits;
+
+        // Counters of the elements occupying each position, packed into
+        // 64-bit words.
+        filter_storage<uint64_t> words;
+
+        // The number of counters.
+        size_t size;
+
+        // Mask selecting a counter when the size is a power of two, otherwise
+        // 0, in which case a counter is selected with a division.
+        size_t mask;
+
+        // The number of probes made for every element.
+        size_t k;
+
+        // Hash policy which produces the probes for an element.
+        Hasher hasher;
+
+        // The number of saturated counters, counted as they saturate. A loaded
+        // filter counts them the first time they are asked for.
+        mutable size_t saturated_count = 0;
+        mutable bool saturated_counted = true;
+
+        // The number of increments lost to saturated counters since the filter
+        // was built, reset or loaded.
+        size_t overflow_count = 0;
+
+        size_t index(uint64_t h) const { return select_position(h, mask, size); }
+
+        uint64_t counter(size_t c) const {
+            return words[c / per_word] >> (c % per_word * Bits) & max_count;
+        }
+
+        void increment(size_t c) {
+            uint64_t& w = words[c / per_word];
+            unsigned shift = c % per_word * Bits;
+            uint64_t v = w >> shift & max_count;
+            if(v == max_count) {
+                overflow_count++;
+                return;
+            }
+            w += 1ull << shift;
+            saturated_count += v + 1 == max_count;
+        }
+
+        void decrement(size_t c) {
+            uint64_t& w = words[c / per_word];
+            unsigned shift = c % per_word * Bits;
+            uint64_t v = w >> shift & max_count;
+            if(v != 0 && v != max_count) {
+                w -= 1ull << shift;
+            }
+        }
+
+
+    public:
+
+        /** Inserts an element into the bloom filter by hashing it once and
+         * incrementing the counter of each of its k probes.
+         *
+         * \param str The string to insert into the bloom filter
+         */
+        void insert(std::string_view str) {
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                increment(index(d[i]));
+            }
+        }
+
+        /** Tests if a string is in the bloom filter by hashing it once and
+         * checking the counters of all its k probes are above 0.
+         *
+         * \param  str The string to test for membership
+         * \return     True if the string is in the set, false otherwise.
+         */
+        bool test_membership(std::string_view str) const {
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                if(!counter(index(d[i]))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /** Removes an element by decrementing the counter of each of its k
+         * probes. Nothing is removed unless the element tests as a member, so
+         * removing an element which was never inserted usually does no harm;
+         * when it is a false positive, it removes part of other elements and
+         * can cause false negatives.
+         *
+         * \param  str The string to remove from the bloom filter.
+         * \return     True if the string was in the set and was removed.
+         */
+        bool remove(std::string_view str) {
+            typename Hasher::digest d = hasher(str);
+            for(size_t i = 0; i < k; i++) {
+                if(!counter(index(d[i]))) {
+                    return false;
+                }
+            }
+            for(size_t i = 0; i < k; i++) {
+                decrement(index(d[i]));
+            }
+            return true;
+        }
+
+        /** Inserts a batch of elements. Keys are hashed a group at a time and
+         * the words of all their probes are prefetched before any is counted.
+         *
+         * \param keys The strings to insert into the bloom filter.
+         * \param n    The number of strings.
+         */
+        void insert_batch(const std::string_view* keys, size_t n) {
+            insert_probes(hasher, k, keys, n,
+                          [this](uint64_t h) { return index(h); },
+                          [this](size_t j) { return &words[j / per_word]; },
+                          [this](size_t j) { increment(j); });
+        }
+
+        /** Tests a batch of elements for membership. Keys are hashed a group
+         * at a time and the words of all their probes are prefetched before
+         * any is tested.
+         *
+         * \param  keys The strings to test for membership.
+         * \param  n    The number of strings, at most `batch_size`.
+         * \return      A mask with bit i set if keys[i] is in the set.
+         */
+        uint64_t test_membership_batch(const std::string_view* keys, size_t n) const {
+            return test_probes(hasher, k, keys, n,
+                               [this](uint64_t h) { return index(h); },
+                               [this](size_t j) { return &words[j / per_word]; },
+                               [this](size_t j) { return counter(j) != 0; });
+        }
+
+        /// The number of bits taken by the counters.
+        size_t bits() const { return size * Bits; }
+
+        /// The number of probes made for every element.
+        size_t hashes() const { return k; }
+
+        /// The number of counters.
+        size_t counters() const { return size; }
+
+        /// The number of counters which have saturated and can no longer be
+        /// decremented.
+        size_t saturated() const {
+            if(!saturated_counted) {
+                saturated_count = 0;
+                for(size_t c = 0; c < size; c++) {
+                    saturated_count += counter(c) == max_count;
+                }
+                saturated_counted = true;
+            }
+            return saturated_count;
+        }
+
+        /// The number of increments lost to saturated counters since the
+        /// filter was built, reset or loaded.
+        size_t overflows() const { return overflow_count; }
+
+        /** Describes the filter as a JSON object, treating every counter
+         * above 0 as a set bit. The counters are read on every call.
+         */
+        std::string stats() const {
+            size_t set = 0;
+            for(size_t c = 0; c < size; c++) {
+                set += counter(c) != 0;
+            }
+            json_object json;
+            json.field("mode", "counting").field("bits", (uint64_t) bits()).field("hashes", (uint64_t) k)
+                .field("counters", (uint64_t) size).field("counter_bits", (uint64_t) Bits);
+            add_fill_stats(json, size, set, k);
+            json.field("saturated", (uint64_t) saturated()).field("overflows", (uint64_t) overflow_count);
+            return json.str();
+        }
+
+        /** Resets every counter to 0. */
+        void reset() {
+            std::fill(words.data(), words.data() + words.size(), 0);
+            saturated_count = 0;
+            saturated_counted = true;
+            overflow_count = 0;
+        };
+
+        /** Saves the bloom filter to a file which `load` can map back in.
+         *
+         * \param path The path of the file to write.
+         */
+        void save(const std::string& path) const {
+            filter_header header = {};
+            header.layout = static_cast<uint32_t>(counting_layout(Bits));
+            header.hash = Hasher::id;
+            header.k = k;
+            header.size = size;
+            save_filter(path, header, hasher.state(), words.data(), words.size() * sizeof(uint64_t));
+        }
+
+        /** Loads a counting bloom filter saved by `save` with counters of the
+         * same width. The words are mapped rather than read, and only copied
+         * as they are written to.
+         *
+         * \param  path   The path of the file to load.
+         * \param  verify Whether to check the words against their checksum.
+         * \return        The loaded bloom filter.
+         */
+        static counting_bloom_filter load(const std::string& path, bool verify = false) {
+            saved_filter f = open_filter(path, counting_layout(Bits), Hasher::id, verify);
+            size_t count = (f.header.size + per_word - 1) / per_word;
+            if(f.header.size == 0 || f.header.payload_bytes != count * sizeof(uint64_t)) {
+                throw std::runtime_error(path + " has the wrong number of words");
+            }
+            return counting_bloom_filter(filter_storage<uint64_t>(f.file, f.header.payload_offset, count),
+                                         f.header.size, f.header.k, Hasher::from_state(f.state));
+        }
+
+        /** Initializes the bloom filter.
+         *
+         * \param size   The number of counters and corresponding index.
+         * \param k      The number of probes made for every element.
+         * \param hasher The hash policy producing the probes.
+         */
+        counting_bloom_filter(size_t size, size_t k, Hasher hasher = Hasher())
+            : words((size + per_word - 1) / per_word), size(size), mask(pow2_mask(size)), k(k),
+              hasher(std::move(hasher)) {};
+
+        /** Initializes the bloom filter with parameters chosen by
+         * `filter_params::for_fp_rate`, with one counter for every bit they
+         * call for.
+         *
+         * \param params The size and number of probes.
+         * \param hasher The hash policy producing the probes.
+         */
+        explicit counting_bloom_filter(const filter_params& params, Hasher hasher = Hasher())
+            : counting_bloom_filter(params.bits, params.hashes, std::move(hasher)) {};
+
+    private:
+
+        /** Initializes the bloom filter over existing words. */
+        counting_bloom_filter(filter_storage<uint64_t> words, size_t size, size_t k, Hasher hasher)
+            : words(std::move(words)), size(size), mask(pow2_mask(size)), k(k),
+              hasher(std::move(hasher)), saturated_counted(false) {};
+
+};
+
+
+/// Class implementation for the scalable bloom filter, which holds an unbounded
+/// number of elements at a bounded false positive rate. Elements go into the
+/// newest of a series of classic filters. Once its fill ratio crosses a limit,
+/// a filter `growth` times larger with a false positive rate `tightening`
+/// times lower is added, so the rates of all filters sum to at most the
+/// target. The hash policy must provide any number of probes, since later
+/// filters make more of them.
+template <typename Hasher = wyhash>
+class scalable_bloom_filter {
+
+    private:
+
+        // The filters, oldest first. Only the last one is inserted into.
+        std::vector<bloom_filter<Hasher>> filters;
+
+        // The number of elements and false positive rate of the first filter.
+        size_t initial_items;
+        double initial_fp_rate;
+
+        // The number of elements and false positive rate of the next filter.
+        size_t items;
+        double fp_rate;
+
+        // How much larger and tighter each filter is than the one before.
+        double growth;
+        double tightening;
+
+        // The fill ratio at which a new filter is added.
+        double fill_limit;
+
+        // Hash policy which produces the probes for an element.
+        Hasher hasher;
+
+        /** Adds a filter sized for the next number of elements and false
+         * positive rate.
+         */
+        void grow() {
+            filters.emplace_back(filter_params::for_fp_rate(items, fp_rate), hasher);
+            items = std::max<size_t>(items * growth, items + 1);
+            fp_rate *= tightening;
+        }
+
+        /** Returns the filter to insert into, adding one if it is full. */
+        bloom_filter<Hasher>& active() {
+            if(filters.back().fill_ratio() >= fill_limit) {
+                grow();
+            }
+            return filters.back();
+        }
+
+
+    public:
+
+        /** Inserts an element into the newest filter.
+         *
+         * \param str The string to insert into the bloom filter
+         */
+        void insert(std::string_view str) { active().insert(str); }
+
+        /** Tests if a string is in any of the filters, newest first.
+         *
+         * \param  str The string to test for membership
+         * \return     True if the string is in the set, false otherwise.
+         */
+        bool test_membership(std::string_view str) const {
+            for(auto f = filters.rbegin(); f != filters.rend(); f++) {
+                if(f->test_membership(str)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /** Inserts a batch of elements. The fill ratio is checked every
+         * `prefetch_group` elements, so a filter may take a few elements more
+         * than its limit.
+         *
+         * \param keys The strings to insert into the bloom filter.
+         * \param n    The number of strings.
+         */
+        void insert_batch(const std::string_view* keys, size_t n) {
+            for(size_t g = 0; g < n; g += prefetch_group) {
+                active().insert_batch(keys + g, std::min(prefetch_group, n - g));
+            }
+        }
+
+        /** Tests a batch of elements for membership, newest filter first.
+         * Older filters are only asked about the elements not found yet.
+         *
+         * \param  keys The strings to test for membership.
+         * \param  n    The number of strings, at most `batch_size`.
+         * \return      A mask with bit i set if keys[i] is in the set.
+         */
+        uint64_t test_membership_batch(const std::string_view* keys, size_t n) const {
+            uint64_t all = n == 64 ? ~0ull : (1ull << n) - 1;
+            uint64_t found = 0;
+            for(auto f = filters.rbegin(); f != filters.rend() && found != all; f++) {
+                found |= f->test_membership_batch(keys, n);
+            }
+            return found;
+        }
+
+        /// The number of bits over all filters.
+        size_t bits() const {
+            size_t total = 0;
+            for(const bloom_filter<Hasher>& f : filters) {
+                total += f.bits();
+            }
+            return total;
+        }
+
+        /// The number of probes made for an element by the newest filter.
+        size_t hashes() const { return filters.back().hashes(); }
+
+        /// The number of filters.
+        size_t depth() const { return filters.size(); }
+
+        /** Describes the filter as a JSON object, with the statistics of
+         * every filter it holds, oldest first.
+         */
+        std::string stats() const {
+            std::string list;
+            for(const bloom_filter<Hasher>& f : filters) {
+                list += (list.empty() ? "" : ",") + f.stats();
+            }
+            return json_object().field("mode", "scalable").field("bits", (uint64_t) bits())
+                .field("depth", (uint64_t) depth()).raw("filters", "[" + list + "]").str();
+        }
+
+        /** Drops every filter but a new first one. */
+        void reset() {
+            filters.clear();
+            items = initial_items;
+            fp_rate = initial_fp_rate;
+            grow();
+        }
+
+        /** Scalable filters cannot be saved yet. */
+        void save(const std::string&) const {
+            throw std::runtime_error("scalable filters cannot be saved");
+        }
+
+        /** Scalable filters cannot be loaded yet. */
+        static scalable_bloom_filter load(const std::string&, bool = false) {
+            throw std::runtime_error("scalable filters cannot be loaded");
+        }
+
+        /** Initializes the scalable bloom filter.
+         *
+         * \param items      The number of elements the first filter is sized
+         *                   for.
+         * \param fp_rate    The false positive rate the whole filter should
+         *                   stay below.
+         * \param hasher     The hash policy producing the probes.
+         * \param growth     How much larger each filter is than the last.
+         * \param tightening How much lower the false positive rate of each
+         *                   filter is than that of the last.
+         * \param fill_limit The fill ratio at which a new filter is added.
+         */
+        scalable_bloom_filter(size_t items, double fp_rate, Hasher hasher = Hasher(),
+                              double growth = 2, double tightening = 0.5, double fill_limit = 0.5)
+            : initial_items(items), initial_fp_rate(fp_rate * (1 - tightening)),
+              growth(growth), tightening(tightening), fill_limit(fill_limit),
+              hasher(std::move(hasher)) {
+            reset();
+        };
+
+};
+
+
+/// Class implementation for the xor filter, an immutable filter which answers
+/// a membership test with 3 memory accesses and takes about 9.8 bits per key
+/// at a false positive rate of 1/256. Inserted keys are only hashed and kept
+/// until `build` is called, which solves for an 8-bit fingerprint table such
+/// that the 3 entries chosen by a key xor to its fingerprint. Once built, no
+/// more keys can be inserted until the filter is reset.
+template <typename Hasher = wyhash>
+class xor_filter {
+
+    public:
+
+        /// The number of bits in a fingerprint.
+        static constexpr unsigned fingerprint_bits = 8;
+
+    private:
+
+        // The fingerprint table, split into 3 blocks of `block_length`
+        // entries. Each key has one entry in every block.
+        filter_storage<uint8_t> fingerprints;
+
+        // The number of entries in each block.
+        size_t block_length = 0;
+
+        // The seed mixed into the key hashes, chosen when the table is built.
+        uint64_t seed = 0;
+
+        // The number of distinct keys the table was built from.
+        size_t keys = 0;
+
+        // Hash policy which hashes the keys.
+        Hasher hasher;
+
+        // Hashes of the keys inserted since the last build.
+        std::vector<uint64_t> pending;
+
+        // Whether the table has been built.
+        bool built = false;
+
+        /** Mixes a key hash with the seed, so that every attempt at building
+         * the table places the keys differently.
+         */
+        static uint64_t mix(uint64_t h, uint64_t seed) {
+            h += seed;
+            h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+            h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+            return h ^ (h >> 33);
+        }
+
+        static uint64_t rotl(uint64_t h, unsigned r) { return (h << r) | (h >> (64 - r)); }
+
+        /** Maps 32 bits of a hash onto [0, n) without a division. */
+        static size_t reduce(uint64_t h, size_t n) { return ((h & 0xffffffffull) * n) >> 32; }
+
+        static uint8_t fingerprint(uint64_t h) { return (uint8_t) (h ^ (h >> 32)); }
+
+        /** Fills in the entry of a mixed hash in each of the 3 blocks. */
+        void locate(uint64_t h, size_t* j) const {
+            j[0] = reduce(h, block_length);
+            j[1] = reduce(rotl(h, 21), block_length) + block_length;
+            j[2] = reduce(rotl(h, 42), block_length) + 2 * block_length;
+        }
+
+        /** Tries to build the table from distinct key hashes with the current
+         * seed, by repeatedly peeling off an entry used by a single key.
+         *
+         * \param  hashes The key hashes.
+         * \param  table  The fingerprint table, overwritten.
+         * \return        False if the keys could not all be peeled.
+         */
+        bool try_build(const std::vector<uint64_t>& hashes, std::vector<uint8_t>& table) const {
+            size_t capacity = 3 * block_length;
+            std::vector<uint32_t> count(capacity, 0);
+            std::vector<uint64_t> xors(capacity, 0);
+            size_t j[3];
+            for(uint64_t key : hashes) {
+                uint64_t h = mix(key, seed);
+                locate(h, j);
+                for(size_t i = 0; i < 3; i++) {
+                    count[j[i]]++;
+                    xors[j[i]] ^= h;
+                }
+            }
+
+            // Entries used by one key, and the keys peeled off with their
+            // entries, in the order they were peeled.
+            std::vector<size_t> single;
+            for(size_t e = 0; e < capacity; e++) {
+                if(count[e] == 1) {
+                    single.push_back(e);
+                }
+            }
+            std::vector<std::pair<uint64_t, size_t>> peeled;
+            peeled.reserve(hashes.size());
+            while(!single.empty()) {
+                size_t e = single.back();
+                single.pop_back();
+                if(count[e] != 1) {
+                    continue;
+                }
+                uint64_t h = xors[e];
+                peeled.emplace_back(h, e);
+                locate(h, j);
+                for(size_t i = 0; i < 3; i++) {
+                    xors[j[i]] ^= h;
+                    if(--count[j[i]] == 1) {
+                        single.push_back(j[i]);
+                    }
+                }
+            }
+            if(peeled.size() != hashes.size()) {
+                return false;
+            }
+
+            // Keys are assigned in the reverse order they were peeled, so the
+            // entry of each key is free when it is assigned.
+            std::fill(table.begin(), table.end(), 0);
+            for(auto p = peeled.rbegin(); p != peeled.rend(); p++) {
+                locate(p->first, j);
+                table[p->second] = 0;
+                table[p->second] = fingerprint(p->first) ^ table[j[0]] ^ table[j[1]] ^ table[j[2]];
+            }
+            return true;
+        }
+
+
+    public:
+
+        /** Inserts an element by hashing it. It only joins the table when the
+         * filter is built.
+         *
+         * \param str The string to insert into the filter.
+         */
+        void insert(std::string_view str) {
+            if(built) {
+                throw std::runtime_error("an xor filter cannot be inserted into once built");
+            }
+            pending.push_back(hasher(str)[0]);
+        }
+
+        /** Inserts a batch of elements by hashing them.
+         *
+         * \param keys The strings to insert into the filter.
+         * \param n    The number of strings.
+         */
+        void insert_batch(const std::string_view* keys, size_t n) {
+            for(size_t i = 0; i < n; i++) {
+                insert(keys[i]);
+            }
+        }
+
+        /** Builds the fingerprint table from the elements inserted so far.
+         * Does nothing if no elements are waiting to be built. Construction
+         * fails with a small probability for a given seed, in which case it is
+         * retried with the next one.
+         */
+        void build() {
+            if(pending.empty()) {
+                return;
+            }
+            std::sort(pending.begin(), pending.end());
+            pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+            keys = pending.size();
+            block_length = (32 + (size_t) std::ceil(1.23 * keys)) / 3;
+            std::vector<uint8_t> table(3 * block_length);
+            for(seed = 0x9e3779b97f4a7c15ull; !try_build(pending, table); seed += 0x9e3779b97f4a7c15ull) {}
+
+            filter_storage<uint8_t> storage(table.size());
+            std::copy(table.begin(), table.end(), storage.data());
+            fingerprints = std::move(storage);
+            std::vector<uint64_t>().swap(pending);
+            built = true;
+        }
+
+        /** Tests if a string is in the filter by checking whether its 3
+         * entries xor to its fingerprint. Elements inserted since the last
+         * `build` are not found.
+         *
+         * \param  str The string to test for membership.
+         * \return     True if the string is in the set, false otherwise.
+         */
+        bool test_membership(std::string_view str) const {
+            if(!built) {
+                return false;
+            }
+            uint64_t h = mix(hasher(str)[0], seed);
+            size_t j[3];
+            locate(h, j);
+            return fingerprint(h) == (fingerprints[j[0]] ^ fingerprints[j[1]] ^ fingerprints[j[2]]);
+        }
+
+        /** Tests a batch of elements for membership. Keys are hashed a group
+         * at a time and their entries are prefetched before any is tested.
+         *
+         * \param  keys The strings to test for membership.
+         * \param  n    The number of strings, at most `batch_size`.
+         * \return      A mask with bit i set if keys[i] is in the set.
+         */
+        uint64_t test_membership_batch(const std::string_view* keys, size_t n) const {
+            if(!built) {
+                return 0;
+            }
+            uint64_t found = 0;
+            uint64_t h[prefetch_group];
+            size_t j[prefetch_group][3];
+            for(size_t g = 0; g < n; g += prefetch_group) {
+                size_t m = std::min(prefetch_group, n - g);
+                for(size_t i = 0; i < m; i++) {
+                    h[i] = mix(hasher(keys[g + i])[0], seed);
+                    locate(h[i], j[i]);
+                    for(size_t p = 0; p < 3; p++) {
+                        __builtin_prefetch(&fingerprints[j[i][p]], 0);
+                    }
+                }
+                for(size_t i = 0; i < m; i++) {
+                    uint8_t f = fingerprints[j[i][0]] ^ fingerprints[j[i][1]] ^ fingerprints[j[i][2]];
+                    found |= (uint64_t) (fingerprint(h[i]) == f) << (g + i);
+                }
+            }
+            return found;
+        }
+
+        /// The number of bits in the fingerprint table.
+        size_t bits() const { return fingerprints.size() * fingerprint_bits; }
+
+        /// The number of entries read for every test.
+        size_t hashes() const { return 3; }
+
+        /// The number of distinct keys the table was built from.
+        size_t size() const { return keys; }
+
+        /** Describes the filter as a JSON object. */
+        std::string stats() const {
+            return json_object().field("mode", "xor").field("bits", (uint64_t) bits())
+                .field("keys", (uint64_t) keys).field("pending", (uint64_t) pending.size())
+                .field("bits_per_key", keys ? (double) bits() / keys : 0.0)
+                .field("expected_fp_rate", keys ? 1.0 / (1 << fingerprint_bits) : 0.0).str();
+        }
+
+        /** Empties the filter, so that keys can be inserted again. */
+        void reset() {
+            fingerprints = filter_storage<uint8_t>();
+            block_length = 0;
+            keys = 0;
+            pending.clear();
+            built = false;
+        };
+
+        /** Saves the built filter to a file which `load` can map back in. The
+         * seed of the table is saved after the state of the hash policy.
+         *
+         * \param path The path of the file to write.
+         */
+        void save(const std::string& path) const {
+            if(!pending.empty()) {
+                throw std::runtime_error("an xor filter must be built before it is saved");
+            }
+            std::vector<uint64_t> state = hasher.state();
+            state.push_back(seed);
+            filter_header header = {};
+            header.layout = static_cast<uint32_t>(filter_layout::xor8);
+            header.hash = Hasher::id;
+            header.k = 3;
+            header.size = keys;
+            save_filter(path, header, state, fingerprints.data(), fingerprints.size());
+        }
+
+        /** Loads an xor filter saved by `save`. The table is mapped rather
+         * than read, and is never written to.
+         *
+         * \param  path   The path of the file to load.
+         * \param  verify Whether to check the table against its checksum.
+         * \return        The loaded filter.
+         */
+        static xor_filter load(const std::string& path, bool verify = false) {
+            saved_filter f = open_filter(path, filter_layout::xor8, Hasher::id, verify);
+            if(f.state.empty() || f.header.payload_bytes % 3 != 0) {
+                throw std::runtime_error(path + " has the wrong number of words");
+            }
+            uint64_t seed = f.state.back();
+            f.state.pop_back();
+            xor_filter xf(Hasher::from_state(f.state));
+            xf.fingerprints = filter_storage<uint8_t>(f.file, f.header.payload_offset, f.header.payload_bytes);
+            xf.block_length = f.header.payload_bytes / 3;
+            xf.seed = seed;
+            xf.keys = f.header.size;
+            xf.built = xf.block_length > 0;
+            return xf;
+        }
+
+        /** Initializes an empty xor filter.
+         *
+         * \param hasher The hash policy hashing the keys.
+         */
+        explicit xor_filter(Hasher hasher = Hasher()) : hasher(std::move(hasher)) {};
+
+};
+
+
+/// Whether a filter must be built after its last insert before it answers
+/// tests.
+template <typename Filter, typename = void>
+struct needs_build : std::false_type {};
+
+template <typename Filter>
+struct needs_build<Filter, std::void_t<decltype(std::declval<Filter&>().build())>>
+    : std::true_type {};
+
+/** Builds a filter from the elements inserted since it was last built. Does
+ * nothing for filters which answer tests as soon as elements are inserted.
+ *
+ * \param bf The filter.
+ */
+template <typename Filter>
+void build_filter(Filter& bf) {
+    if constexpr (needs_build<Filter>::value) {
+        bf.build();
+    }
+}
+
+
+/** Constructs an sfold hash policy from a given list of seeds.
+ *
+ * \param k     The number of seeds, one per probe, that should be chosen.
+ * \param seeds The list of seeds that the k probes should choose from
+ *              wihtout replacement.
+ * \return      The sfold policy using the chosen seeds.
+ */
+inline sfold construct_random_sfold_hashs(size_t k, std::vector<size_t> seeds) {
+
+    if(k > seeds.size()) {
+        throw std::invalid_argument("not enough seeds for " + std::to_string(k) + " sfold hashs");
+    }
+
+    // Rather than run a choice function (which this library doesn't have), we
+    // equivalently just shuffle all the elements of the vector and just take
+    // the first k.
+    rand_gen::shuffle(seeds);
+    seeds.resize(k);
+    return sfold(seeds);
+}
+
+/** Generates all primes less than n using the Sieve of Erastosthenes method.
+ *
+ * \param n The upper limit for the primes.
+ * \return  A vector containing all the primes between 2 and n.
+ */
+inline std::vector<size_t> gen_primes(size_t n) {
+    std::vector<size_t> p;
+    std::vector<bool> p_test(n, true);
+    for(size_t i = 2; i < n; i++) {
+        if(p_test[i]) {
+            p.push_back(i);
+            for(size_t j = (i * i); j < n; j += i) {
+                p_test[j] = false;
+            }
+        }
+    }
+    return p;
+}
+
+#endif
@@ -0,0 +1,313 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cmath>
+
+#include "bloomfilter.hpp"
+
+
+/// One configuration of the sweep.
+struct config {
+    std::string mode;
+    std::string hash;
+    size_t size;
+    size_t k;
+    size_t train;
+
+    // Seeds the shuffle of the word list.
+    uint64_t seed;
+
+    // The seeds of the sfold policy, chosen up front since the random
+    // generator is shared between threads.
+    std::vector<uint64_t> sfold_seeds;
+
+    // The target false positive rate of a scalable filter.
+    double fp_rate = 0;
+};
+
+/// The measurements of one configuration.
+struct result {
+    size_t bits;
+    size_t hashes;
+    size_t false_negatives;
+    double fp_rate;
+    double theoretical_fp_rate;
+    double insert_ns;
+    double query_ns;
+};
+
+
+double theoretical_fp_rate(const std::string& mode, size_t bits, size_t hashes, size_t n) {
+    if(mode == "blocked") {
+        return blocked_fp_rate(bits / 512.0, hashes / 8.0, n);
+    } else if(mode == "counting") {
+        return classic_fp_rate(bits / counting_bloom_filter<>::counter_bits, hashes, n);
+    } else if(mode == "xor") {
+        return n ? 1.0 / (1 << xor_filter<>::fingerprint_bits) : 0;
+    }
+    return classic_fp_rate(bits, hashes, n);
+}
+
+
+/** Inserts the training words into a filter, then tests the training words
+ * for false negatives and the remaining words for false positives. Building a
+ * filter which needs it counts towards the time of the inserts.
+ *
+ * \param  bf    The empty filter.
+ * \param  train The words inserted.
+ * \param  test  The words which were not inserted.
+ * \return       The measurements.
+ */
+template <typename Filter>
+result measure(Filter& bf, const std::vector<std::string_view>& train,
+               const std::vector<std::string_view>& test) {
+    using clock = std::chrono::steady_clock;
+    result r = {};
+
+    auto start = clock::now();
+    for(size_t i = 0; i < train.size(); i += batch_size) {
+        bf.insert_batch(&train[i], std::min(batch_size, train.size() - i));
+    }
+    build_filter(bf);
+    auto inserted = clock::now();
+
+    for(size_t i = 0; i < train.size(); i += batch_size) {
+        size_t n = std::min(batch_size, train.size() - i);
+        r.false_negatives += n - __builtin_popcountll(bf.test_membership_batch(&train[i], n));
+    }
+
+    auto queried = clock::now();
+    size_t positives = 0;
+    for(size_t i = 0; i < test.size(); i += batch_size) {
+        size_t n = std::min(batch_size, test.size() - i);
+        positives += __builtin_popcountll(bf.test_membership_batch(&test[i], n));
+    }
+    auto end = clock::now();
+
+    r.bits = bf.bits();
+    r.hashes = bf.hashes();
+    r.fp_rate = test.empty() ? 0 : (double) positives / test.size();
+    r.insert_ns = std::chrono::duration<double, std::nano>(inserted - start).count()
+        / std::max<size_t>(train.size(), 1);
+    r.query_ns = std::chrono::duration<double, std::nano>(end - queried).count()
+        / std::max<size_t>(test.size(), 1);
+    return r;
+}
+
+/** Builds the filter of a configuration's mode and measures it. */
+template <typename Hasher>
+result measure(const config& c, Hasher hasher, const std::vector<std::string_view>& train,
+               const std::vector<std::string_view>& test) {
+    if(c.mode == "blocked") {
+        blocked_bloom_filter<Hasher> bf(c.size, c.k, std::move(hasher));
+        return measure(bf, train, test);
+    } else if(c.mode == "concurrent") {
+        concurrent_bloom_filter<Hasher> bf(c.size, c.k, std::move(hasher));
+        return measure(bf, train, test);
+    } else if(c.mode == "counting") {
+        counting_bloom_filter<Hasher> bf(c.size, c.k, std::move(hasher));
+        return measure(bf, train, test);
+    } else if(c.mode == "xor") {
+        xor_filter<Hasher> bf(std::move(hasher));
+        return measure(bf, train, test);
+    } else if(c.mode == "scalable") {
+        scalable_bloom_filter<Hasher> bf(c.train, c.fp_rate, std::move(hasher));
+        return measure(bf, train, test);
+    }
+    bloom_filter<Hasher> bf(c.size, c.k, std::move(hasher));
+    return measure(bf, train, test);
+}
+
+/** Shuffles the words, splits them into training and test words, and measures
+ * the configuration on them.
+ */
+result run_config(const config& c, const std::vector<std::string>& words) {
+    std::vector<std::string_view> shuffled(words.begin(), words.end());
+    std::mt19937_64 rng(c.seed);
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    size_t n = std::min(c.train, shuffled.size());
+    std::vector<std::string_view> train(shuffled.begin(), shuffled.begin() + n);
+    std::vector<std::string_view> test(shuffled.begin() + n, shuffled.end());
+
+    result r = c.hash == "sfold"
+        ? measure(c, sfold::from_state(c.sfold_seeds), train, test)
+        : measure(c, wyhash(c.seed), train, test);
+    // A scalable filter is only bounded by its target rate.
+    r.theoretical_fp_rate = c.mode == "scalable"
+        ? c.fp_rate
+        : theoretical_fp_rate(c.mode, r.bits, r.hashes, n);
+    return r;
+}
+
+
+/** Splits a comma separated list. */
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+std::vector<size_t> split_sizes(const std::string& list) {
+    std::vector<size_t> items;
+    for(const std::string& item : split(list)) {
+        items.push_back(std::stoull(item));
+    }
+    return items;
+}
+
+int main(int argc, char** argv) {
+
+    std::string path = "wlist_match7.txt";
+    std::vector<std::string> modes = {"classic", "blocked", "concurrent", "counting", "xor",
+                                      "scalable"};
+    std::vector<std::string> hashes = {"wyhash"};
+    std::vector<size_t> sizes = {1 << 4, 1 << 8, 1 << 12, 1 << 16, 1 << 20};
+    std::vector<size_t> num_hashs = {8, 16, 32, 64};
+    std::vector<size_t> num_train = {100, 250, 500, 750, 1000, 2500, 5000, 7500, 10000, 25000};
+    double fp_rate = 0.01;
+    size_t jobs = 1;
+    uint64_t seed = 0;
+
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--modes" && i + 1 < argc) {
+            modes = split(argv[++i]);
+        } else if(arg == "--hash" && i + 1 < argc) {
+            hashes = split(argv[++i]);
+        } else if(arg == "--sizes" && i + 1 < argc) {
+            sizes = split_sizes(argv[++i]);
+        } else if(arg == "--hashs" && i + 1 < argc) {
+            num_hashs = split_sizes(argv[++i]);
+        } else if(arg == "--train" && i + 1 < argc) {
+            num_train = split_sizes(argv[++i]);
+        } else if(arg == "--fp" && i + 1 < argc) {
+            fp_rate = std::stod(argv[++i]);
+        } else if(arg == "--jobs" && i + 1 < argc) {
+            jobs = std::max(std::stoi(argv[++i]), 1);
+        } else if(arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if(arg == "--help") {
+            std::cout << "Usage: bloomfilter_bench [word list]\n"
+                      << "Options: [--modes classic,blocked,concurrent,counting,xor,scalable]\n"
+                      << "         [--hash wyhash,sfold] [--sizes 16,256,...] [--hashs 8,16,...]\n"
+                      << "         [--train 100,250,...] [--fp P] [--jobs N] [--seed S]" << std::endl;
+            return 0;
+        } else {
+            path = arg;
+        }
+    }
+
+    for(const std::string& mode : modes) {
+        if(mode != "classic" && mode != "blocked" && mode != "concurrent" && mode != "counting"
+           && mode != "xor" && mode != "scalable") {
+            std::cerr << "Unknown filter mode: " << mode << std::endl;
+            return 1;
+        }
+    }
+    for(const std::string& hash : hashes) {
+        if(hash != "wyhash" && hash != "sfold") {
+            std::cerr << "Unknown hash policy: " << hash << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::string> words;
+    std::ifstream file(path);
+    std::string line;
+    while(std::getline(file, line)) {
+        if(!line.empty()) {
+            words.push_back(line);
+        }
+    }
+    if(words.empty()) {
+        std::cerr << "Error: no words in " << path << std::endl;
+        return 1;
+    }
+
+    rand_gen::seed(seed);
+    std::vector<size_t> primes = gen_primes(10000);
+    std::vector<config> configs;
+    for(const std::string& mode : modes) {
+        for(const std::string& hash : hashes) {
+            // The xor filter takes a single 64-bit hash of each key, the
+            // blocked filter the high bits of each probe, and the scalable
+            // filter any number of probes, none of which sfold can provide.
+            if((mode == "xor" || mode == "blocked" || mode == "scalable") && hash == "sfold") {
+                continue;
+            }
+            // The xor filter is sized by its keys alone, and the scalable
+            // filter by the number of training words and the target rate, so
+            // they are measured once per training size, with a size and number
+            // of hashes of 0.
+            if(mode == "xor" || mode == "scalable") {
+                for(size_t train : num_train) {
+                    configs.push_back(config{mode, hash, 0, 0, train, seed + configs.size(), {}, fp_rate});
+                }
+                continue;
+            }
+            for(size_t size : sizes) {
+                for(size_t k : num_hashs) {
+                    for(size_t train : num_train) {
+                        config c = {mode, hash, size, k, train, seed + configs.size(), {}};
+                        if(hash == "sfold") {
+                            c.sfold_seeds = construct_random_sfold_hashs(k, primes).state();
+                        }
+                        configs.push_back(c);
+                    }
+                }
+            }
+        }
+    }
+
+    // Configurations are handed out one at a time, so that threads which draw
+    // cheap ones move on to the next.
+    std::vector<result> results(configs.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for(size_t i = next++; i < configs.size(); i = next++) {
+            results[i] = run_config(configs[i], words);
+        }
+    };
+    std::vector<std::thread> pool;
+    for(size_t t = 1; t < jobs; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(std::thread& t : pool) {
+        t.join();
+    }
+
+    bool false_negatives = false;
+    std::cout << "mode,hash,bloomfilter_size,num_hashs,num_train_words,bits,hashes,"
+              << "fp_rate,theoretical_fp_rate,false_negatives,insert_ns_per_op,"
+              << "query_ns_per_op,queries_per_sec,bits_per_key\n";
+    for(size_t i = 0; i < configs.size(); i++) {
+        const config& c = configs[i];
+        const result& r = results[i];
+        size_t n = std::min(c.train, words.size());
+        std::cout << c.mode << ',' << c.hash << ',' << c.size << ',' << c.k << ',' << c.train << ','
+                  << r.bits << ',' << r.hashes << ',' << r.fp_rate << ',' << r.theoretical_fp_rate << ','
+                  << r.false_negatives << ',' << r.insert_ns << ',' << r.query_ns << ','
+                  << (r.query_ns > 0 ? 1e9 / r.query_ns : 0) << ','
+                  << (double) r.bits / std::max<size_t>(n, 1) << '\n';
+        false_negatives |= r.false_negatives > 0;
+    }
+    std::cout << std::flush;
+
+    if(false_negatives) {
+        std::cerr << "Error: false negatives encountered" << std::endl;
+        return 1;
+    }
+    return 0;
+}
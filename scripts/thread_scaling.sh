@@ -0,0 +1,61 @@
+#!/usr/bin/env bash
+#
+# Measures how `bloomfilter --threads N` scales with the number of threads.
+#
+# Builds two command files from the word list, each word taken with a numeric
+# suffix. The bulk file inserts every word, then tests every inserted word and
+# as many words that were never inserted. The interleaved file alternates
+# groups of 16 inserts with tests of the same 16 words, so every phase is
+# small, which shows the cost of starting a phase. Each file is then run once per
+# thread count and the ns/op reported by --time is printed as CSV. Every row, including the one
+# for a single thread, uses the filter with atomic words, so only the thread
+# count changes between rows.
+#
+# Usage: scripts/thread_scaling.sh [copies] [max threads]
+
+set -euo pipefail
+
+cd "$(dirname "$0")/.."
+
+copies=${1:-20}
+max_threads=${2:-$(nproc)}
+binary=build/bloomfilter
+words=wlist_match7.txt
+commands=$(mktemp)
+interleaved=$(mktemp)
+trap 'rm -f "$commands" "$interleaved"' EXIT
+
+awk -v copies="$copies" '
+    { w[NR] = $1 }
+    END {
+        for (c = 0; c < copies; c++) for (i = 1; i <= NR; i++) print "insert " w[i] c
+        for (c = 0; c < copies; c++) for (i = 1; i <= NR; i++) print "testmembership " w[i] c
+        for (c = 0; c < copies; c++) for (i = 1; i <= NR; i++) print "testmembership " w[i] "-" c
+    }' "$words" > "$commands"
+
+awk -v copies="$copies" '
+    { w[NR] = $1 }
+    END {
+        for (c = 0; c < copies; c++) for (g = 1; g <= NR; g += 16) {
+            for (i = g; i < g + 16 && i <= NR; i++) print "insert " w[i] c
+            for (i = g; i < g + 16 && i <= NR; i++) print "testmembership " w[i] c
+        }
+    }' "$words" > "$interleaved"
+
+keys=$(($(wc -l < "$words") * copies))
+size=$((keys * 10))
+
+echo "workload,threads,keys,ns_per_op"
+for workload in bulk interleaved; do
+    file=$commands
+    if [ "$workload" = interleaved ]; then
+        file=$interleaved
+    fi
+    threads=1
+    while [ "$threads" -le "$max_threads" ]; do
+        ns=$("$binary" "$size" 7 "$file" --threads "$threads" --time 2>&1 >/dev/null \
+            | sed -n 's/.*(\(.*\) ns\/op)/\1/p')
+        echo "$workload,$threads,$keys,$ns"
+        threads=$((threads * 2))
+    done
+done